@@ -22,5 +22,11 @@ public class OnlineSubsystemTheia : ModuleRules
 				"Json"
 			}
 			);
+
+		// Beacon batches go through recvmmsg/sendmmsg on the BSD socket descriptor
+		PrivateIncludePaths.Add("Runtime/Sockets/Private");
+
+		// Session advertisements are deflated with a preset dictionary, which FCompression can't do
+		AddEngineThirdPartyPrivateStaticDependencies(Target, "zlib");
 	}
 }
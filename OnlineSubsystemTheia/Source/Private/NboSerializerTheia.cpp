@@ -0,0 +1,210 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#include "NboSerializerTheia.h"
+#include "OnlineSubsystem.h"
+#include "Misc/ConfigCacheIni.h"
+#include "Misc/Crc.h"
+#include "Interfaces/IPv4/IPv4Address.h"
+
+/** Forms a compact string takes, stored in the low bits of its varint header */
+enum ETheiaCompactStringForm
+{
+	/** UTF-8 text, the length is in the rest of the header */
+	CompactString_Text = 0,
+	/** A GUID in its default 32 digit form, sent as 16 bytes */
+	CompactString_Guid = 1,
+	/** A dotted IPv4 address, sent as 4 bytes */
+	CompactString_IPv4 = 2
+};
+
+/** Marks a setting whose value type has no compact form, the plain NBO form follows */
+#define THEIA_COMPACT_SETTING_PLAIN 0xff
+
+const FTheiaSettingKeyDictionary& FTheiaSettingKeyDictionary::Get()
+{
+	static FTheiaSettingKeyDictionary Dictionary;
+	return Dictionary;
+}
+
+FTheiaSettingKeyDictionary::FTheiaSettingKeyDictionary() :
+	TableId(0)
+{
+	// Never reorder or remove, ids are positions in this list
+	Keys.Add(SETTING_MAPNAME);
+	Keys.Add(SETTING_GAMEMODE);
+	Keys.Add(SETTING_NUMBOTS);
+	Keys.Add(SETTING_BEACONPORT);
+	Keys.Add(SETTING_QOS);
+	Keys.Add(SETTING_REGION);
+	Keys.Add(SETTING_DCID);
+	Keys.Add(SETTING_CUSTOM);
+
+	TArray<FString> GameKeys;
+	GConfig->GetArray(TEXT("LANSession"), TEXT("CompactSettingKeys"), GameKeys, GEngineIni);
+	for (const FString& GameKey : GameKeys)
+	{
+		if (Keys.Num() >= MAX_uint8)
+		{
+			UE_LOG(LogOnline, Warning, TEXT("Too many CompactSettingKeys, %s and later keys are sent by name"), *GameKey);
+			break;
+		}
+		Keys.AddUnique(FName(*GameKey));
+	}
+
+	for (const FName& Key : Keys)
+	{
+		TableId = FCrc::StrCrc32(*Key.ToString(), TableId);
+	}
+}
+
+void FNboSerializeToBufferTheia::WriteCompactString(const FString& String)
+{
+	// Only strings that read back exactly, FString == ignores case and lower case hex would come back upper case
+	FGuid Guid;
+	if (String.Len() == 32 && FGuid::Parse(String, Guid) && Guid.ToString().Equals(String, ESearchCase::CaseSensitive))
+	{
+		WriteVarUInt(CompactString_Guid);
+		*this << Guid.A << Guid.B << Guid.C << Guid.D;
+		return;
+	}
+
+	FIPv4Address Address;
+	if (String.Len() <= 15 && FIPv4Address::Parse(String, Address) && Address.ToString().Equals(String, ESearchCase::CaseSensitive))
+	{
+		WriteVarUInt(CompactString_IPv4);
+		*this << Address.Value;
+		return;
+	}
+
+	FTCHARToUTF8 Converted(*String);
+	WriteVarUInt((uint32)Converted.Length() << 2 | CompactString_Text);
+	WriteBinary((const uint8*)Converted.Get(), Converted.Length());
+}
+
+void FNboSerializeFromBufferTheia::ReadCompactString(FString& OutString)
+{
+	OutString.Empty();
+	const uint32 Header = ReadVarUInt();
+	if (bHasOverflow)
+	{
+		return;
+	}
+
+	switch (Header & 3)
+	{
+	case CompactString_Text:
+	{
+		const int32 Length = (int32)(Header >> 2);
+		if (Length > NumBytes - CurrentOffset)
+		{
+			bHasOverflow = true;
+			return;
+		}
+		// Converted in place, no copy of the raw bytes
+		FUTF8ToTCHAR Converted((const ANSICHAR*)&Data[CurrentOffset], Length);
+		OutString = FString(Converted.Length(), Converted.Get());
+		CurrentOffset += Length;
+		break;
+	}
+	case CompactString_Guid:
+	{
+		FGuid Guid;
+		*this >> Guid.A >> Guid.B >> Guid.C >> Guid.D;
+		OutString = Guid.ToString();
+		break;
+	}
+	case CompactString_IPv4:
+	{
+		FIPv4Address Address;
+		*this >> Address.Value;
+		OutString = Address.ToString();
+		break;
+	}
+	default:
+		bHasOverflow = true;
+		break;
+	}
+}
+
+void FNboSerializeToBufferTheia::WriteCompactSetting(const FOnlineSessionSetting& Setting)
+{
+	const EOnlineKeyValuePairDataType::Type Type = Setting.Data.GetType();
+	const uint8 Header = (uint8)(Type << 2) | (uint8)(Setting.AdvertisementType & 3);
+	switch (Type)
+	{
+	case EOnlineKeyValuePairDataType::Empty:
+		*this << Header;
+		break;
+	case EOnlineKeyValuePairDataType::Int32:
+	{
+		int32 Value = 0;
+		Setting.Data.GetValue(Value);
+		// The base operator returns the base buffer, which knows nothing of the compact forms
+		*this << Header;
+		*this << TheiaCompact(Value);
+		break;
+	}
+	case EOnlineKeyValuePairDataType::Bool:
+	{
+		bool bValue = false;
+		Setting.Data.GetValue(bValue);
+		*this << Header << (uint8)bValue;
+		break;
+	}
+	case EOnlineKeyValuePairDataType::String:
+	{
+		FString Value;
+		Setting.Data.GetValue(Value);
+		*this << Header;
+		*this << TheiaCompact(Value);
+		break;
+	}
+	default:
+		// Rare enough that the plain form will do
+		*this << (uint8)THEIA_COMPACT_SETTING_PLAIN << Setting;
+		break;
+	}
+}
+
+void FNboSerializeFromBufferTheia::ReadCompactSetting(FOnlineSessionSetting& OutSetting)
+{
+	uint8 Header = 0;
+	*this >> Header;
+	if (Header == THEIA_COMPACT_SETTING_PLAIN)
+	{
+		*this >> OutSetting;
+		return;
+	}
+
+	OutSetting.AdvertisementType = (EOnlineDataAdvertisementType::Type)(Header & 3);
+	switch (Header >> 2)
+	{
+	case EOnlineKeyValuePairDataType::Empty:
+		OutSetting.Data.Empty();
+		break;
+	case EOnlineKeyValuePairDataType::Int32:
+	{
+		int32 Value = 0;
+		*this >> TheiaCompact(Value);
+		OutSetting.Data.SetValue(Value);
+		break;
+	}
+	case EOnlineKeyValuePairDataType::Bool:
+	{
+		uint8 Value = 0;
+		*this >> Value;
+		OutSetting.Data.SetValue(Value != 0);
+		break;
+	}
+	case EOnlineKeyValuePairDataType::String:
+	{
+		FString Value;
+		*this >> TheiaCompact(Value);
+		OutSetting.Data.SetValue(Value);
+		break;
+	}
+	default:
+		bHasOverflow = true;
+		break;
+	}
+}
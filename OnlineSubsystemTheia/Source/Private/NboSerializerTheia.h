@@ -4,8 +4,91 @@
 
 #include "CoreMinimal.h"
 #include "OnlineSubsystemTheiaTypes.h"
+#include "OnlineSessionSettings.h"
 #include "NboSerializer.h"
 
+/**
+ * Marks a value to be written in the compact session format rather than its
+ * plain NBO form. Use TheiaCompact(Value) with either buffer:
+ *
+ *	int32		zigzag varint, 1 byte up to +-63
+ *	FString		varint length and UTF-8, GUIDs as 16 bytes and IPv4 addresses as 4
+ *	FName		one byte id for keys in FTheiaSettingKeyDictionary, otherwise its name
+ *	FOnlineSessionSetting	type and advertisement in one byte, then the value in compact form
+ */
+template<typename ValueType>
+struct TTheiaCompact
+{
+	ValueType& Value;
+
+	explicit TTheiaCompact(ValueType& InValue) :
+		Value(InValue)
+	{
+	}
+
+	/** Lets a wrapped non-const value be written */
+	template<typename OtherType, typename = typename TEnableIf<TAreTypesEqual<const OtherType, ValueType>::Value>::Type>
+	TTheiaCompact(const TTheiaCompact<OtherType>& Other) :
+		Value(Other.Value)
+	{
+	}
+};
+
+template<typename ValueType>
+inline TTheiaCompact<ValueType> TheiaCompact(ValueType& Value)
+{
+	return TTheiaCompact<ValueType>(Value);
+}
+
+template<typename ValueType>
+inline TTheiaCompact<const ValueType> TheiaCompact(const ValueType& Value)
+{
+	return TTheiaCompact<const ValueType>(Value);
+}
+
+/**
+ * Setting keys most sessions advertise, sent as a one byte id instead of their name.
+ * Games append their own with +CompactSettingKeys in [LANSession]. Queries carry the
+ * table id, hosts send keys by name to clients whose list differs
+ */
+class FTheiaSettingKeyDictionary
+{
+public:
+
+	/** @return the dictionary, built on first use */
+	static const FTheiaSettingKeyDictionary& Get();
+
+	/** @return the id of the key, 0 if it has to be sent by name */
+	uint8 FindId(FName Key) const
+	{
+		const int32 Index = Keys.IndexOfByKey(Key);
+		return (uint8)(Index + 1);
+	}
+
+	/** @return the key with the given id, NAME_None if there is none */
+	FName FindKey(uint8 Id) const
+	{
+		return (Id > 0 && Id <= Keys.Num()) ? Keys[Id - 1] : NAME_None;
+	}
+
+	/** @return a hash of every key in order, equal only for dictionaries that give out the same ids */
+	uint32 GetTableId() const
+	{
+		return TableId;
+	}
+
+private:
+
+	/** Hidden on purpose, use Get() */
+	FTheiaSettingKeyDictionary();
+
+	/** Known keys, the id of each is its index plus one */
+	TArray<FName> Keys;
+
+	/** See GetTableId */
+	uint32 TableId;
+};
+
 /**
  * Serializes data in network byte order form into a buffer
  */
@@ -14,16 +97,79 @@ class FNboSerializeToBufferTheia : public FNboSerializeToBuffer
 public:
 	/** Default constructor zeros num bytes*/
 	FNboSerializeToBufferTheia() :
-		FNboSerializeToBuffer(512)
+		FNboSerializeToBuffer(512),
+		bWriteKeysByName(false)
 	{
 	}
 
 	/** Constructor specifying the size to use */
 	FNboSerializeToBufferTheia(uint32 Size) :
-		FNboSerializeToBuffer(Size)
+		FNboSerializeToBuffer(Size),
+		bWriteKeysByName(false)
 	{
 	}
 
+	/** Writes every setting key by name, for readers whose FTheiaSettingKeyDictionary differs */
+	void SetWriteKeysByName(bool bInWriteKeysByName)
+	{
+		bWriteKeysByName = bInWriteKeysByName;
+	}
+
+	/** Writes an unsigned varint, 7 bits per byte with the high bit set on all but the last */
+	void WriteVarUInt(uint32 Value)
+	{
+		uint8 Bytes[5];
+		int32 NumBytes = 0;
+		do
+		{
+			Bytes[NumBytes] = (uint8)(Value & 0x7f);
+			Value >>= 7;
+			if (Value != 0)
+			{
+				Bytes[NumBytes] |= 0x80;
+			}
+			NumBytes++;
+		}
+		while (Value != 0);
+		WriteBinary(Bytes, NumBytes);
+	}
+
+	/** Writes a string in the compact form, see TTheiaCompact */
+	void WriteCompactString(const FString& String);
+
+	/** Writes a setting value in the compact form, see TTheiaCompact */
+	void WriteCompactSetting(const FOnlineSessionSetting& Setting);
+
+	friend inline FNboSerializeToBufferTheia& operator<<(FNboSerializeToBufferTheia& Ar, const TTheiaCompact<const int32>& Compact)
+	{
+		// Zigzag so small negative values stay short too
+		Ar.WriteVarUInt(((uint32)Compact.Value << 1) ^ (uint32)(Compact.Value >> 31));
+		return Ar;
+	}
+
+	friend inline FNboSerializeToBufferTheia& operator<<(FNboSerializeToBufferTheia& Ar, const TTheiaCompact<const FString>& Compact)
+	{
+		Ar.WriteCompactString(Compact.Value);
+		return Ar;
+	}
+
+	friend inline FNboSerializeToBufferTheia& operator<<(FNboSerializeToBufferTheia& Ar, const TTheiaCompact<const FName>& Compact)
+	{
+		const uint8 Id = Ar.bWriteKeysByName ? 0 : FTheiaSettingKeyDictionary::Get().FindId(Compact.Value);
+		Ar << Id;
+		if (Id == 0)
+		{
+			Ar.WriteCompactString(Compact.Value.ToString());
+		}
+		return Ar;
+	}
+
+	friend inline FNboSerializeToBufferTheia& operator<<(FNboSerializeToBufferTheia& Ar, const TTheiaCompact<const FOnlineSessionSetting>& Compact)
+	{
+		Ar.WriteCompactSetting(Compact.Value);
+		return Ar;
+	}
+
 	/**
 	 * Adds Null session info to the buffer
 	 */
@@ -32,7 +178,9 @@ public:
 		check(SessionInfo.HostAddr.IsValid());
 		// Skip SessionType (assigned at creation)
 		Ar << SessionInfo.SessionId;
-		Ar << *SessionInfo.HostAddr;
+		// Addresses go out as text so IPv6 fits, the compact form shrinks IPv4 back to 4 bytes
+		Ar << TheiaCompact(SessionInfo.HostAddr->ToString(false));
+		Ar << TheiaCompact(SessionInfo.HostAddr->GetPort());
 		return Ar;
  	}
 
@@ -41,9 +189,15 @@ public:
 	 */
 	friend inline FNboSerializeToBufferTheia& operator<<(FNboSerializeToBufferTheia& Ar, const FUniqueNetIdString& UniqueId)
 	{
-		Ar << UniqueId.UniqueNetIdStr;
+		// Ids are usually GUIDs, sent as 16 bytes rather than 32 characters
+		Ar << TheiaCompact(UniqueId.UniqueNetIdStr);
 		return Ar;
 	}
+
+private:
+
+	/** See SetWriteKeysByName */
+	bool bWriteKeysByName;
 };
 
 /**
@@ -60,6 +214,90 @@ public:
 	{
 	}
 
+	/** Reads an unsigned varint written by WriteVarUInt */
+	uint32 ReadVarUInt()
+	{
+		uint32 Value = 0;
+		for (int32 Shift = 0; Shift < 35 && !bHasOverflow; Shift += 7)
+		{
+			uint8 Byte = 0;
+			*this >> Byte;
+			Value |= (uint32)(Byte & 0x7f) << Shift;
+			if ((Byte & 0x80) == 0)
+			{
+				return Value;
+			}
+		}
+		// Longer than any uint32
+		bHasOverflow = true;
+		return 0;
+	}
+
+	/** Reads a string written by WriteCompactString */
+	void ReadCompactString(FString& OutString);
+
+	/** Reads a setting written by WriteCompactSetting */
+	void ReadCompactSetting(FOnlineSessionSetting& OutSetting);
+
+	/** @return the offset of the next byte to be read */
+	int32 GetReadOffset() const
+	{
+		return CurrentOffset;
+	}
+
+	/** @return the number of bytes not read yet */
+	int32 GetBytesLeft() const
+	{
+		return NumBytes - CurrentOffset;
+	}
+
+	/** Flags the rest of the buffer as unreadable, for data that is malformed rather than short */
+	void MarkMalformed()
+	{
+		bHasOverflow = true;
+	}
+
+	friend inline FNboSerializeFromBufferTheia& operator>>(FNboSerializeFromBufferTheia& Ar, const TTheiaCompact<int32>& Compact)
+	{
+		const uint32 ZigZag = Ar.ReadVarUInt();
+		Compact.Value = (int32)(ZigZag >> 1) ^ -(int32)(ZigZag & 1);
+		return Ar;
+	}
+
+	friend inline FNboSerializeFromBufferTheia& operator>>(FNboSerializeFromBufferTheia& Ar, const TTheiaCompact<FString>& Compact)
+	{
+		Ar.ReadCompactString(Compact.Value);
+		return Ar;
+	}
+
+	friend inline FNboSerializeFromBufferTheia& operator>>(FNboSerializeFromBufferTheia& Ar, const TTheiaCompact<FName>& Compact)
+	{
+		uint8 Id = 0;
+		Ar >> Id;
+		if (Id == 0)
+		{
+			FString Name;
+			Ar.ReadCompactString(Name);
+			Compact.Value = FName(*Name);
+		}
+		else
+		{
+			Compact.Value = FTheiaSettingKeyDictionary::Get().FindKey(Id);
+			if (Compact.Value == NAME_None)
+			{
+				// The host knows keys we don't, its dictionary is configured differently
+				Ar.MarkMalformed();
+			}
+		}
+		return Ar;
+	}
+
+	friend inline FNboSerializeFromBufferTheia& operator>>(FNboSerializeFromBufferTheia& Ar, const TTheiaCompact<FOnlineSessionSetting>& Compact)
+	{
+		Ar.ReadCompactSetting(Compact.Value);
+		return Ar;
+	}
+
 	/**
 	 * Reads Null session info from the buffer
 	 */
@@ -67,8 +305,13 @@ public:
  	{
 		check(SessionInfo.HostAddr.IsValid());
 		// Skip SessionType (assigned at creation)
-		Ar >> SessionInfo.SessionId; 
-		Ar >> *SessionInfo.HostAddr;
+		Ar >> SessionInfo.SessionId;
+		FString HostAddrText;
+		int32 HostPort = 0;
+		Ar >> TheiaCompact(HostAddrText) >> TheiaCompact(HostPort);
+		bool bIsValid = false;
+		SessionInfo.HostAddr->SetIp(*HostAddrText, bIsValid);
+		SessionInfo.HostAddr->SetPort(HostPort);
 		return Ar;
  	}
 
@@ -77,7 +320,7 @@ public:
 	 */
 	friend inline FNboSerializeFromBufferTheia& operator>>(FNboSerializeFromBufferTheia& Ar, FUniqueNetIdString& UniqueId)
 	{
-		Ar >> UniqueId.UniqueNetIdStr;
+		Ar >> TheiaCompact(UniqueId.UniqueNetIdStr);
 		return Ar;
 	}
 };
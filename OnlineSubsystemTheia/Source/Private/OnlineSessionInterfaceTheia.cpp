@@ -9,11 +9,22 @@
 #include "OnlineAsyncTaskManager.h"
 #include "SocketSubsystem.h"
 #include "NboSerializerTheia.h"
+#include "TheiaQueryFilters.h"
+#include "TheiaCompression.h"
 //#include "IPv4address.h"
 
 FOnlineSessionInfoTheia::FOnlineSessionInfoTheia() :
 	HostAddr(NULL),
-	SessionId(TEXT("INVALID"))
+	SessionId(TEXT("INVALID")),
+	PendingSettings(NULL),
+	PendingSettingsLength(0),
+	bHasLazySettings(false),
+	bAreLazySettingsDecoded(false),
+	bAreLazySettingsMalformed(false),
+	bIsInSearchArena(false),
+	ResponseVersionKey(0),
+	bIsResponsePayloadDirty(true),
+	ResponsePayloadSerial(0)
 {
 }
 
@@ -309,6 +320,14 @@ bool FOnlineSessionTheia::IsSessionJoinable(const FNamedOnlineSession& Session)
 	return bIsAdvertised && bJoinableFromProgress && bAreSpacesAvailable;
 }
 
+bool FOnlineSessionTheia::ShouldAnswerQuery(const FNamedOnlineSession& Session) const
+{
+	const FOnlineSessionSettings& Settings = Session.SessionSettings;
+
+	const bool bIsMatchInProgress = Session.SessionState == EOnlineSessionState::InProgress;
+
+	return (!bIsMatchInProgress || Settings.bAllowJoinInProgress) && Settings.NumPublicConnections > 0;
+}
 
 uint32 FOnlineSessionTheia::UpdateTheiaStatus()
 {
@@ -317,13 +336,12 @@ uint32 FOnlineSessionTheia::UpdateTheiaStatus()
 	if ( NeedsToAdvertise() )
 	{
 		// set up LAN session
-		if (TheiaSessionManager.GetBeaconState() == ELanBeaconState::NotUsingLanBeacon)
+		if (!TheiaSessionManager.IsHosting())
 		{
-			TheiaSessionManager.IsLANMatch = false;
 			FURL DefaultURL;
 			DefaultURL.LoadURLConfig(TEXT("DefaultPlayer"), GGameIni);
 
-			HostSessionPort = DefaultURL.Port + 1;
+			HostSessionPort = DefaultURL.Port + THEIA_BEACON_PORT_OFFSET;
 		//	HostSessionPort = DefaultURL.Port;
 
 			FOnValidQueryPacketDelegate QueryPacketDelegate = FOnValidQueryPacketDelegate::CreateRaw(this, &FOnlineSessionTheia::OnValidQueryPacketReceived);
@@ -333,18 +351,17 @@ uint32 FOnlineSessionTheia::UpdateTheiaStatus()
 			{
 				Result = E_FAIL;
 
-				TheiaSessionManager.StopTheiaSession();
+				TheiaSessionManager.StopHosting();
 			}
 		}
 	}
 	else
 	{
-		if (TheiaSessionManager.GetBeaconState() != ELanBeaconState::Searching)
+		// Searching no longer holds up advertising, the beacon answers queries either way
+		if (!TheiaSessionManager.IsHosting())
 		{
 			if ((Sessions.Num() > 0) && Sessions[0].SessionSettings.bIsLANMatch)
 			{
-				TheiaSessionManager.IsLANMatch = true;
-
 				FOnValidQueryPacketDelegate QueryPacketDelegate = FOnValidQueryPacketDelegate::CreateRaw(this, &FOnlineSessionTheia::OnValidQueryPacketReceived);
 				FOnPortChangedDelegate PortChangedDelegate = FOnPortChangedDelegate::CreateRaw(this, &FOnlineSessionTheia::OnSessionListenPortChanged);
 				//TODO: if its a LAN Connection just send port 1 for now, maybe change this...
@@ -353,7 +370,7 @@ uint32 FOnlineSessionTheia::UpdateTheiaStatus()
 				{
 					Result = E_FAIL;
 
-					TheiaSessionManager.StopTheiaSession();
+					TheiaSessionManager.StopHosting();
 				}
 
 			}
@@ -382,6 +399,7 @@ bool FOnlineSessionTheia::StartSession(FName SessionName)
 			// If this lan match has join in progress disabled, shut down the beacon
 			Result = UpdateTheiaStatus();
 			Session->SessionState = EOnlineSessionState::InProgress;
+			InvalidateResponsePayload(*Session);
 		}
 		else
 		{
@@ -419,6 +437,7 @@ bool FOnlineSessionTheia::UpdateSession(FName SessionName, FOnlineSessionSetting
 	{
 		// @TODO ONLINE update LAN settings
 		Session->SessionSettings = UpdatedSessionSettings;
+		InvalidateResponsePayload(*Session);
 		TriggerOnUpdateSessionCompleteDelegates(SessionName, bWasSuccessful);
 	}
 
@@ -437,6 +456,7 @@ bool FOnlineSessionTheia::EndSession(FName SessionName)
 		if (Session->SessionState == EOnlineSessionState::InProgress)
 		{
 			Session->SessionState = EOnlineSessionState::Ended;
+			InvalidateResponsePayload(*Session);
 
 			// If the session should be advertised and the lan beacon was destroyed, recreate
 			Result = UpdateTheiaStatus();
@@ -522,8 +542,6 @@ bool FOnlineSessionTheia::CancelMatchmaking(const FUniqueNetId& SearchingPlayerI
 bool FOnlineSessionTheia::FindSessions(int32 SearchingPlayerNum, const TSharedRef<FOnlineSessionSearch>& SearchSettings)
 {
 	uint32 Return = E_FAIL;
-	//int32 HostSessionAddr = 0x345a2aee;
-	//int32 HostSessionPort = 7777;
 
 	// Don't start another search while one is in progress
 	if (!CurrentSessionSearch.IsValid() && SearchSettings->SearchState != EOnlineAsyncTaskState::InProgress)
@@ -536,17 +554,21 @@ bool FOnlineSessionTheia::FindSessions(int32 SearchingPlayerNum, const TSharedRe
 
 		// remember the time at which we started search, as this will be used for a "good enough" ping estimation
 		SessionSearchStartInSeconds = FPlatformTime::Seconds();
+		PendingSearchResults.Reset();
+		SeenSearchSessionIds.Reset();
+		NextKnownSearchResults.Reset();
+		if (SearchSettings->bIsLanQuery != bKnownSearchResultsAreLAN)
+		{
+			KnownSearchResults.Reset();
+			bKnownSearchResultsAreLAN = SearchSettings->bIsLanQuery;
+		}
 
+		bool bHasSearchHosts = true;
 		if (!SearchSettings->bIsLanQuery)
 		{
 			UE_LOG(LogOnline, Warning, TEXT("Searching for online session"))
 			TheiaSessionManager.IsLANMatch = false;
-			//SetHostAddr(SearchSettings);
-			//SetHostPort(SearchSettings);
-	//int32 HostSessionAddr = 0x345a2aee;
-	//int32 HostSessionPort = 7777;
-			TheiaSessionManager.HostSessionPort = 7777;
-			TheiaSessionManager.HostSessionAddr = 0x345a2aee;
+			bHasSearchHosts = SetSearchHosts(SearchSettings);
 
 			FURL DefaultURL;
 			DefaultURL.LoadURLConfig(TEXT("DefaultPlayer"), GGameIni);
@@ -557,14 +579,26 @@ bool FOnlineSessionTheia::FindSessions(int32 SearchingPlayerNum, const TSharedRe
 		{
 			TheiaSessionManager.IsLANMatch = true;
 		}
-		UE_LOG(LogOnline, Warning, TEXT("executing FindLanSession"))
 
-		// Check if its a LAN query
-		Return = FindTheiaSession();
+		if (bHasSearchHosts)
+		{
+			UE_LOG(LogOnline, Warning, TEXT("executing FindLanSession"))
+
+			// Check if its a LAN query
+			Return = FindTheiaSession();
 
-		if (Return == ERROR_IO_PENDING)
+			if (Return == ERROR_IO_PENDING)
+			{
+				SearchSettings->SearchState = EOnlineAsyncTaskState::InProgress;
+			}
+		}
+		else
 		{
-			SearchSettings->SearchState = EOnlineAsyncTaskState::InProgress;
+			// A config error, there is nobody to ask
+			UE_LOG_ONLINE(Error, TEXT("Online search has no hosts to query, set HostSessionAddr on the search or SearchHosts in [LANSession]"));
+			SearchSettings->SearchState = EOnlineAsyncTaskState::Failed;
+			CurrentSessionSearch = NULL;
+			TriggerOnFindSessionsCompleteDelegates(false);
 		}
 	}
 	else
@@ -603,6 +637,19 @@ uint32 FOnlineSessionTheia::FindTheiaSession()
 
 	FNboSerializeToBufferTheia Packet(LAN_BEACON_MAX_PACKET_SIZE);
 	TheiaSessionManager.CreateClientQueryPacket(Packet, TheiaSessionManager.TheiaNonce);
+	// Sessions the last search read, hosts send back only the id of those that did not change
+	TArray<uint64> KnownSessionKeys;
+	for (const TPair<FString, FTheiaKnownSearchResult>& Known : KnownSearchResults)
+	{
+		if (KnownSessionKeys.Num() >= THEIA_QUERY_MAX_KNOWN_SESSIONS)
+		{
+			break;
+		}
+		KnownSessionKeys.Add(FTheiaQueryFilters::MakeSessionVersionKey(Known.Key, Known.Value.Version));
+	}
+
+	// Let hosts leave out the sessions this search would filter out anyway
+	FTheiaQueryFilters::WriteToPacket(Packet, CurrentSessionSearch->QuerySettings, true, KnownSessionKeys);
 	if (TheiaSessionManager.Search(Packet, ResponseDelegate, TimeoutDelegate) == false)
 	{
 		Return = E_FAIL;
@@ -627,6 +674,8 @@ bool FOnlineSessionTheia::CancelFindSessions()
 
 		FinalizeTheiaSearch();
 
+		// Whatever was found so far stays readable
+		DecodeSearchResults(CurrentSessionSearch->SearchResults);
 		CurrentSessionSearch->SearchState = EOnlineAsyncTaskState::Failed;
 		CurrentSessionSearch = NULL;
 	}
@@ -653,28 +702,41 @@ bool FOnlineSessionTheia::JoinSession(int32 PlayerNum, FName SessionName, const
 	{
 		// Create a named session from the search result data
 		Session = AddNamedSession(SessionName, DesiredSession.Session);
-		Session->HostingPlayerNum = PlayerNum;
-		UE_LOG(LogOnline, Warning, TEXT("Joining session"))
+		if (!DecodeSearchResultSettings(*Session))
+		{
+			UE_LOG_ONLINE(Warning, TEXT("Can't join session (%s), its advertised settings are malformed"), *SessionName.ToString());
+			RemoveNamedSession(SessionName);
+		}
+		else
+		{
+			// The owner id came from the search arena, which must not live as long as the match
+			if (Session->OwningUserId.IsValid())
+			{
+				Session->OwningUserId = MakeShareable(new FUniqueNetIdString(*StaticCastSharedPtr<const FUniqueNetIdString>(Session->OwningUserId)));
+			}
+			Session->HostingPlayerNum = PlayerNum;
+			UE_LOG(LogOnline, Warning, TEXT("Joining session"))
 
-		// Create Internet or LAN match
-		FOnlineSessionInfoTheia* NewSessionInfo = new FOnlineSessionInfoTheia();
-		Session->SessionInfo = MakeShareable(NewSessionInfo);
+			// Create Internet or LAN match
+			FOnlineSessionInfoTheia* NewSessionInfo = new FOnlineSessionInfoTheia();
+			Session->SessionInfo = MakeShareable(NewSessionInfo);
 
-		Return = JoinTheiaSession(PlayerNum, Session, &DesiredSession.Session);
+			Return = JoinTheiaSession(PlayerNum, Session, &DesiredSession.Session);
 
-		// turn off advertising on Join, to avoid clients advertising it over LAN
-		Session->SessionSettings.bShouldAdvertise = false;
+			// turn off advertising on Join, to avoid clients advertising it over LAN
+			Session->SessionSettings.bShouldAdvertise = false;
 
-		if (Return != ERROR_IO_PENDING)
-		{
-			if (Return != ERROR_SUCCESS)
+			if (Return != ERROR_IO_PENDING)
 			{
-				// Clean up the session info so we don't get into a confused state
-				RemoveNamedSession(SessionName);
-			}
-			else
-			{
-				RegisterLocalPlayers(Session);
+				if (Return != ERROR_SUCCESS)
+				{
+					// Clean up the session info so we don't get into a confused state
+					RemoveNamedSession(SessionName);
+				}
+				else
+				{
+					RegisterLocalPlayers(Session);
+				}
 			}
 		}
 	}
@@ -762,30 +824,12 @@ uint32 FOnlineSessionTheia::JoinTheiaSession(int32 PlayerNum, FNamedOnlineSessio
 		FOnlineSessionInfoTheia* SessionInfo = (FOnlineSessionInfoTheia*)Session->SessionInfo.Get();
 		SessionInfo->SessionId = SearchSessionInfo->SessionId;
 
-		if (!TheiaSessionManager.IsLANMatch)
-		{
-			if (TheiaSessionManager.HostSessionAddr)
-			{
-				uint32 IpAddr = TheiaSessionManager.HostSessionAddr;
-
-				SessionInfo->HostAddr = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr(IpAddr, SearchSessionInfo->HostAddr->GetPort());
-
-				UE_LOG(LogOnline, Verbose, TEXT("OnlineSessionInterfaceDirect JoinLANSession Online Session to join HostAdrr is %s "), *SearchSessionInfo->HostAddr->ToString(true));
+		// Online results already carry the address of the host that answered
+		SessionInfo->HostAddr = FTheiaBeacon::CloneAddr(*SearchSessionInfo->HostAddr);
 
-				Result = ERROR_SUCCESS;
+		UE_LOG(LogOnline, Verbose, TEXT("OnlineSessionInterfaceDirect JoinLANSession Session to join HostAdrr is %s "), *SearchSessionInfo->HostAddr->ToString(true));
 
-			}
-		}
-		else
-		{
-			uint32 IpAddr;
-			SearchSessionInfo->HostAddr->GetIp(IpAddr);
-			SessionInfo->HostAddr = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr(IpAddr, SearchSessionInfo->HostAddr->GetPort());
-
-			UE_LOG(LogOnline, Verbose, TEXT("OnlineSessionInterfaceDirect JoinLANSession Session to join HostAdrr is %s "), *SearchSessionInfo->HostAddr->ToString(true));
-
-			Result = ERROR_SUCCESS;
-		}
+		Result = ERROR_SUCCESS;
 	}
 
 	return Result;
@@ -972,6 +1016,7 @@ bool FOnlineSessionTheia::RegisterPlayers(FName SessionName, const TArray< TShar
 				{
 					Session->NumOpenPrivateConnections--;
 				}
+				InvalidateResponsePayload(*Session);
 			}
 			else
 			{
@@ -1023,6 +1068,7 @@ bool FOnlineSessionTheia::UnregisterPlayers(FName SessionName, const TArray< TSh
 				{
 					Session->NumOpenPrivateConnections++;
 				}
+				InvalidateResponsePayload(*Session);
 			}
 			else
 			{
@@ -1048,16 +1094,175 @@ void FOnlineSessionTheia::Tick(float DeltaTime)
 
 void FOnlineSessionTheia::TickLanTasks(float DeltaTime)
 {
+	if (TheiaSessionManager.IsHosting())
+	{
+		RefreshHostedSessionPorts();
+		if (TheiaSessionManager.IsUsingBeaconThread())
+		{
+			PublishHostedResponsePayloads();
+		}
+	}
+
 	TheiaSessionManager.Tick(DeltaTime);
+
+	// Outside of the beacon tick so listeners are free to cancel the search
+	NotifyNewSearchResults();
+}
+
+void FOnlineSessionTheia::NotifyNewSearchResults()
+{
+	if (PendingSearchResults.Num() > 0)
+	{
+		// Moved out first, listeners may cancel the search or start a new one
+		TArray<FOnlineSessionSearchResult> NewResults = MoveTemp(PendingSearchResults);
+		PendingSearchResults.Reset();
+		TriggerOnFindSessionsResultsReceivedDelegates(NewResults);
+	}
+}
+
+void FOnlineSessionTheia::PublishHostedResponsePayloads()
+{
+	TArray<FTheiaHostedPayload> Payloads;
+	{
+		FScopeLock ScopeLock(&SessionLock);
+		// Nothing is serialized or copied unless a session changed or stopped or started answering
+		bool bIsAnyPayloadDirty = false;
+		TArray<uint32> PayloadSerials;
+		for (int32 SessionIndex = 0; SessionIndex < Sessions.Num(); SessionIndex++)
+		{
+			FNamedOnlineSession& Session = Sessions[SessionIndex];
+			if (ShouldAnswerQuery(Session))
+			{
+				const FOnlineSessionInfoTheia& SessionInfo = *StaticCastSharedPtr<FOnlineSessionInfoTheia>(Session.SessionInfo);
+				bIsAnyPayloadDirty |= SessionInfo.bIsResponsePayloadDirty;
+				PayloadSerials.Add(SessionInfo.ResponsePayloadSerial);
+			}
+		}
+
+		// Serials are unique per rebuild, so matching lists mean the beacon thread is up to date
+		if (!bIsAnyPayloadDirty && PayloadSerials == PublishedPayloadSerials && TheiaSessionManager.GetHostedResponsePayloads().IsValid())
+		{
+			return;
+		}
+		PublishedPayloadSerials.Reset();
+
+		for (int32 SessionIndex = 0; SessionIndex < Sessions.Num(); SessionIndex++)
+		{
+			FNamedOnlineSession& Session = Sessions[SessionIndex];
+			if (!ShouldAnswerQuery(Session))
+			{
+				continue;
+			}
+			// Rebuilds the payload if it is dirty, which hands the session a new serial
+			const bool bHasPayload = GetResponsePayload(Session).Num() > 0;
+			PublishedPayloadSerials.Add(StaticCastSharedPtr<FOnlineSessionInfoTheia>(Session.SessionInfo)->ResponsePayloadSerial);
+			if (bHasPayload)
+			{
+				const FOnlineSessionInfoTheia& SessionInfo = *StaticCastSharedPtr<FOnlineSessionInfoTheia>(Session.SessionInfo);
+				FTheiaHostedPayload& Hosted = Payloads[Payloads.AddDefaulted()];
+				Hosted.Payload = SessionInfo.CachedResponsePayload;
+				Hosted.CompressedPayload = SessionInfo.CachedCompressedResponsePayload;
+				Hosted.UnchangedPayload = SessionInfo.CachedUnchangedResponsePayload;
+				Hosted.ByNamePayload = SessionInfo.CachedByNameResponsePayload;
+				Hosted.VersionKey = SessionInfo.ResponseVersionKey;
+				Hosted.Settings = Session.SessionSettings;
+				Hosted.NumOpenPublicConnections = Session.NumOpenPublicConnections;
+			}
+		}
+	}
+
+	TheiaSessionManager.SetHostedResponsePayloads(Payloads);
+}
+
+const TArray<uint8>& FOnlineSessionTheia::GetResponsePayload(FNamedOnlineSession& Session)
+{
+	TSharedPtr<FOnlineSessionInfoTheia> SessionInfo = StaticCastSharedPtr<FOnlineSessionInfoTheia>(Session.SessionInfo);
+	check(SessionInfo.IsValid());
+	if (SessionInfo->bIsResponsePayloadDirty)
+	{
+		SessionInfo->ResponsePayloadSerial = ++NextResponsePayloadSerial;
+		const uint32 Version = SessionInfo->ResponsePayloadSerial;
+
+		// Sessions too big for one response datagram are sent in fragments
+		FNboSerializeToBufferTheia Packet(TheiaSessionManager.GetMaxFragmentedSessionSize());
+		AppendSessionToPacket(Packet, &Session);
+		Packet.WriteVarUInt(Version);
+
+		SessionInfo->CachedResponsePayload.Reset();
+		SessionInfo->CachedCompressedResponsePayload.Reset();
+		SessionInfo->CachedUnchangedResponsePayload.Reset();
+		SessionInfo->CachedByNameResponsePayload.Reset();
+		SessionInfo->ResponseVersionKey = 0;
+		if (!Packet.HasOverflow())
+		{
+			SessionInfo->CachedResponsePayload.Append((uint8*)Packet, Packet.GetByteCount());
+			// Compressed once here, never per query
+			if (TheiaSessionManager.ShouldCompressSessions() &&
+				FTheiaCompression::Compress(SessionInfo->CachedResponsePayload.GetData(), SessionInfo->CachedResponsePayload.Num(), SessionInfo->CachedCompressedResponsePayload) &&
+				SessionInfo->CachedCompressedResponsePayload.Num() + THEIA_COMPRESSION_MIN_SAVING > SessionInfo->CachedResponsePayload.Num())
+			{
+				SessionInfo->CachedCompressedResponsePayload.Reset();
+			}
+
+			// Clients whose setting key table differs can't read key ids, built once here too
+			FNboSerializeToBufferTheia ByName(TheiaSessionManager.GetMaxFragmentedSessionSize());
+			ByName.SetWriteKeysByName(true);
+			AppendSessionToPacket(ByName, &Session);
+			ByName.WriteVarUInt(Version);
+			if (!ByName.HasOverflow())
+			{
+				SessionInfo->CachedByNameResponsePayload.Append((uint8*)ByName, ByName.GetByteCount());
+			}
+
+			FNboSerializeToBufferTheia Unchanged;
+			Unchanged << SessionInfo->SessionId;
+			Unchanged.WriteVarUInt(Version);
+			if (!Unchanged.HasOverflow())
+			{
+				SessionInfo->CachedUnchangedResponsePayload.Append((uint8*)Unchanged, Unchanged.GetByteCount());
+				SessionInfo->ResponseVersionKey = FTheiaQueryFilters::MakeSessionVersionKey(SessionInfo->SessionId.UniqueNetIdStr, Version);
+			}
+		}
+		else
+		{
+			UE_LOG_ONLINE(Warning, TEXT("Session settings need more than %d bytes, cannot advertise session (%s)"), TheiaSessionManager.GetMaxFragmentedSessionSize(), *Session.SessionName.ToString());
+		}
+		SessionInfo->bIsResponsePayloadDirty = false;
+	}
+	return SessionInfo->CachedResponsePayload;
+}
+
+void FOnlineSessionTheia::InvalidateResponsePayload(FNamedOnlineSession& Session)
+{
+	TSharedPtr<FOnlineSessionInfoTheia> SessionInfo = StaticCastSharedPtr<FOnlineSessionInfoTheia>(Session.SessionInfo);
+	if (SessionInfo.IsValid())
+	{
+		SessionInfo->InvalidateResponsePayload();
+	}
+}
+
+void FOnlineSessionTheia::RefreshHostedSessionPorts()
+{
+	const int32 NetDriverPort = GetPortFromNetDriver(TheiaSubsystem->GetInstanceName());
+
+	FScopeLock ScopeLock(&SessionLock);
+	for (int32 SessionIndex = 0; SessionIndex < Sessions.Num(); SessionIndex++)
+	{
+		TSharedPtr<FOnlineSessionInfoTheia> SessionInfo = StaticCastSharedPtr<FOnlineSessionInfoTheia>(Sessions[SessionIndex].SessionInfo);
+		if (SessionInfo.IsValid() && SessionInfo->HostAddr.IsValid() && SessionInfo->HostAddr->GetPort() != NetDriverPort)
+		{
+			SessionInfo->InvalidateResponsePayload();
+		}
+	}
 }
 
 void FOnlineSessionTheia::AppendSessionToPacket(FNboSerializeToBufferTheia& Packet, FOnlineSession* Session)
 {
 	/** Owner of the session */
 	Packet << *StaticCastSharedPtr<const FUniqueNetIdString>(Session->OwningUserId)
-		<< Session->OwningUserName
-		<< Session->NumOpenPrivateConnections
-		<< Session->NumOpenPublicConnections;
+		<< TheiaCompact(Session->OwningUserName)
+		<< TheiaCompact(Session->NumOpenPrivateConnections)
+		<< TheiaCompact(Session->NumOpenPublicConnections);
 
 	// Try to get the actual port the netdriver is using
 	SetPortFromNetDriver(*TheiaSubsystem, Session->SessionInfo);
@@ -1075,20 +1280,26 @@ void FOnlineSessionTheia::AppendSessionSettingsToPacket(FNboSerializeToBufferThe
 	UE_LOG_ONLINE(Verbose, TEXT("Sending session settings to client"));
 #endif 
 
-	// Members of the session settings class
-	Packet << SessionSettings->NumPublicConnections
-		<< SessionSettings->NumPrivateConnections
-		<< (uint8)SessionSettings->bShouldAdvertise
-		<< (uint8)SessionSettings->bIsLANMatch
-		<< (uint8)SessionSettings->bIsDedicated
-		<< (uint8)SessionSettings->bUsesStats
-		<< (uint8)SessionSettings->bAllowJoinInProgress
-		<< (uint8)SessionSettings->bAllowInvites
-		<< (uint8)SessionSettings->bUsesPresence
-		<< (uint8)SessionSettings->bAllowJoinViaPresence
-		<< (uint8)SessionSettings->bAllowJoinViaPresenceFriendsOnly
-		<< (uint8)SessionSettings->bAntiCheatProtected
-	    << SessionSettings->BuildUniqueId;
+	// Members of the session settings class, the bools packed into one value
+	const int32 Flags =
+		(SessionSettings->bShouldAdvertise ? 1 << 0 : 0) |
+		(SessionSettings->bIsLANMatch ? 1 << 1 : 0) |
+		(SessionSettings->bIsDedicated ? 1 << 2 : 0) |
+		(SessionSettings->bUsesStats ? 1 << 3 : 0) |
+		(SessionSettings->bAllowJoinInProgress ? 1 << 4 : 0) |
+		(SessionSettings->bAllowInvites ? 1 << 5 : 0) |
+		(SessionSettings->bUsesPresence ? 1 << 6 : 0) |
+		(SessionSettings->bAllowJoinViaPresence ? 1 << 7 : 0) |
+		(SessionSettings->bAllowJoinViaPresenceFriendsOnly ? 1 << 8 : 0) |
+		(SessionSettings->bAntiCheatProtected ? 1 << 9 : 0);
+	Packet << TheiaCompact(SessionSettings->NumPublicConnections)
+		<< TheiaCompact(SessionSettings->NumPrivateConnections)
+		<< TheiaCompact(Flags)
+		<< TheiaCompact(SessionSettings->BuildUniqueId);
+
+	// The length of the advertised settings is patched in once known, so clients can set them aside undecoded
+	const int32 SettingsLengthOffset = Packet.GetByteCount();
+	Packet << (uint16)0;
 
 	// First count number of advertised keys
 	int32 NumAdvertisedProperties = 0;
@@ -1101,72 +1312,84 @@ void FOnlineSessionTheia::AppendSessionSettingsToPacket(FNboSerializeToBufferThe
 		}
 	}
 
-	// Add count of advertised keys and the data
-	Packet << (int32)NumAdvertisedProperties;
+	// Add count of advertised keys and the data, well known keys go out as a single byte
+	Packet << TheiaCompact(NumAdvertisedProperties);
 	for (FSessionSettings::TConstIterator It(SessionSettings->Settings); It; ++It)
 	{
 		const FOnlineSessionSetting& Setting = It.Value();
 		if (Setting.AdvertisementType >= EOnlineDataAdvertisementType::ViaOnlineService)
 		{
-			Packet << It.Key();
-			Packet << Setting;
+			Packet << TheiaCompact(It.Key());
+			Packet << TheiaCompact(Setting);
 #if DEBUG_LAN_BEACON
 			UE_LOG_ONLINE(Verbose, TEXT("%s"), *Setting.ToString());
 #endif
 		}
 	}
+
+	if (!Packet.HasOverflow())
+	{
+		const int32 SettingsLength = Packet.GetByteCount() - SettingsLengthOffset - (int32)sizeof(uint16);
+		((uint8*)Packet)[SettingsLengthOffset] = (uint8)(SettingsLength >> 8);
+		((uint8*)Packet)[SettingsLengthOffset + 1] = (uint8)SettingsLength;
+	}
 }
 
 void FOnlineSessionTheia::OnValidQueryPacketReceived(uint8* PacketData, int32 PacketLength, uint64 ClientNonce)
 {
+	FTheiaQueryFilters Filters;
+	if (!Filters.ReadFromPacket(PacketData, PacketLength))
+	{
+		UE_LOG_ONLINE(Verbose, TEXT("Ignoring query with malformed search filters"));
+		return;
+	}
+
+	const bool bAcceptsCompression = Filters.AcceptsCompression(FTheiaCompression::GetDictionaryId());
+	const bool bUsesKeyTable = Filters.UsesKeyTable(FTheiaSettingKeyDictionary::Get().GetTableId());
+	FTheiaSession::FSessionPayloadList Payloads;
+
 	// Iterate through all registered sessions and respond for each one that can be joinable
 	FScopeLock ScopeLock(&SessionLock);
 	for (int32 SessionIndex = 0; SessionIndex < Sessions.Num(); SessionIndex++)
 	{
 		FNamedOnlineSession* Session = &Sessions[SessionIndex];
 
-		// Don't respond to query if the session is not a joinable LAN match.
-		//if (Session && IsSessionJoinable(*Session))
-		if (Session)
+		// Don't respond to query if the session is not a joinable LAN match, or the searcher would filter it out
+		if (Session && ShouldAnswerQuery(*Session) && Filters.Matches(Session->SessionSettings, Session->NumOpenPublicConnections))
 		{
-			const FOnlineSessionSettings& Settings = Session->SessionSettings;
-
-			const bool bIsMatchInProgress = Session->SessionState == EOnlineSessionState::InProgress;
-
-			const bool bIsMatchJoinable = (!bIsMatchInProgress || Settings.bAllowJoinInProgress) &&
-				Settings.NumPublicConnections > 0;
+			UE_LOG(LogOnline, Verbose, TEXT("OSID OnValidQueryPacketReceived Match is joinabale"));
 
-			if (bIsMatchJoinable)
+			// Add all the session details, serialized once until the session changes
+			const TArray<uint8>& Payload = GetResponsePayload(*Session);
+			const FOnlineSessionInfoTheia& SessionInfo = *StaticCastSharedPtr<FOnlineSessionInfoTheia>(Session->SessionInfo);
+			if (Payload.Num() == 0)
 			{
-				UE_LOG(LogOnline, Verbose, TEXT("OSID OnValidQueryPacketReceived Match is joinabale"));
-
-				FNboSerializeToBufferTheia Packet(LAN_BEACON_MAX_PACKET_SIZE);
-
-					// Create the basic header before appending additional information
-				TheiaSessionManager.CreateHostResponsePacket(Packet, ClientNonce);
-
-				// Add all the session details
-				AppendSessionToPacket(Packet, Session);
-
-				// Broadcast this response so the client can see us
-				if (!Packet.HasOverflow())
-				{
-					if (!TheiaSessionManager.IsLANMatch)
-					{
-						TheiaSessionManager.BroadcastPacketFromSocket(Packet, Packet.GetByteCount());
-					}
-					else
-					{
-					TheiaSessionManager.BroadcastPacket(Packet, Packet.GetByteCount());
-					}
-				}
-				else
+				continue;
+			}
+			if (SessionInfo.CachedUnchangedResponsePayload.Num() > 0 && Filters.IsKnownSession(SessionInfo.ResponseVersionKey))
+			{
+				Payloads.Add(FTheiaSession::FSessionPayloadRef(&SessionInfo.CachedUnchangedResponsePayload, THEIA_RESPONSE_UNCHANGED_FLAG));
+			}
+			else if (!bUsesKeyTable)
+			{
+				if (SessionInfo.CachedByNameResponsePayload.Num() > 0)
 				{
-					UE_LOG_ONLINE(Warning, TEXT("LAN broadcast packet overflow, cannot broadcast on LAN"));
+					Payloads.Add(FTheiaSession::FSessionPayloadRef(&SessionInfo.CachedByNameResponsePayload, 0));
 				}
 			}
+			else if (bAcceptsCompression && SessionInfo.CachedCompressedResponsePayload.Num() > 0)
+			{
+				Payloads.Add(FTheiaSession::FSessionPayloadRef(&SessionInfo.CachedCompressedResponsePayload, THEIA_RESPONSE_COMPRESSED_FLAG));
+			}
+			else
+			{
+				Payloads.Add(FTheiaSession::FSessionPayloadRef(&Payload, 0));
+			}
 		}
 	}
+
+	// Send the sessions packed into as few datagrams as possible so the client can see us
+	TheiaSessionManager.QueueHostResponses(Payloads, ClientNonce);
 }
 
 void FOnlineSessionTheia::ReadSessionFromPacket(FNboSerializeFromBufferTheia& Packet, FOnlineSession* Session)
@@ -1177,26 +1400,31 @@ void FOnlineSessionTheia::ReadSessionFromPacket(FNboSerializeFromBufferTheia& Pa
 	UE_LOG_ONLINE(Verbose, TEXT("Reading session information from server"));
 #endif
 
+	// Results of a search are all released around the same time, they come from its arena
+	FTheiaSearchArena& Arena = GetSearchArena();
+
 	/** Owner of the session */
-	FUniqueNetIdString* UniqueId = new FUniqueNetIdString;
+	TSharedRef<FUniqueNetIdString> UniqueId = Arena.New<FUniqueNetIdString>();
 	Packet >> *UniqueId
-		>> Session->OwningUserName
-		>> Session->NumOpenPrivateConnections
-		>> Session->NumOpenPublicConnections;
+		>> TheiaCompact(Session->OwningUserName)
+		>> TheiaCompact(Session->NumOpenPrivateConnections)
+		>> TheiaCompact(Session->NumOpenPublicConnections);
 
-	Session->OwningUserId = MakeShareable(UniqueId);
+	Session->OwningUserId = UniqueId;
 
 	// Allocate and read the connection data
-	FOnlineSessionInfoTheia* NullSessionInfo = new FOnlineSessionInfoTheia();
+	TSharedRef<FOnlineSessionInfoTheia> NullSessionInfo = Arena.New<FOnlineSessionInfoTheia>();
+	NullSessionInfo->bIsInSearchArena = true;
+	NumSearchArenaResults++;
 	NullSessionInfo->HostAddr = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr();
 	Packet >> *NullSessionInfo;
-	Session->SessionInfo = MakeShareable(NullSessionInfo); 
+	Session->SessionInfo = NullSessionInfo;
 
-	// Read any per object data using the server object
-	ReadSettingsFromPacket(Packet, Session->SessionSettings);
+	// Read any per object data using the server object, leaving the advertised ones for later if asked to
+	ReadSettingsFromPacket(Packet, Session->SessionSettings, TheiaSessionManager.bLazySearchResultSettings ? &NullSessionInfo.Get() : NULL);
 }
 
-void FOnlineSessionTheia::ReadSettingsFromPacket(FNboSerializeFromBufferTheia& Packet, FOnlineSessionSettings& SessionSettings)
+void FOnlineSessionTheia::ReadSettingsFromPacket(FNboSerializeFromBufferTheia& Packet, FOnlineSessionSettings& SessionSettings, FOnlineSessionInfoTheia* PendingSessionInfo)
 {
 #if DEBUG_LAN_BEACON
 	UE_LOG_ONLINE(Verbose, TEXT("Reading game settings from server"));
@@ -1206,40 +1434,61 @@ void FOnlineSessionTheia::ReadSettingsFromPacket(FNboSerializeFromBufferTheia& P
 	SessionSettings.Settings.Empty();
 
 	// Members of the session settings class
-	Packet >> SessionSettings.NumPublicConnections
-		>> SessionSettings.NumPrivateConnections;
-	uint8 Read = 0;
-	// Read all the bools as bytes
-	Packet >> Read;
-	SessionSettings.bShouldAdvertise = !!Read;
-	Packet >> Read;
-	SessionSettings.bIsLANMatch = !!Read;
-	Packet >> Read;
-	SessionSettings.bIsDedicated = !!Read;
-	Packet >> Read;
-	SessionSettings.bUsesStats = !!Read;
-	Packet >> Read;
-	SessionSettings.bAllowJoinInProgress = !!Read;
-	Packet >> Read;
-	SessionSettings.bAllowInvites = !!Read;
-	Packet >> Read;
-	SessionSettings.bUsesPresence = !!Read;
-	Packet >> Read;
-	SessionSettings.bAllowJoinViaPresence = !!Read;
-	Packet >> Read;
-	SessionSettings.bAllowJoinViaPresenceFriendsOnly = !!Read;
-	Packet >> Read;
-	SessionSettings.bAntiCheatProtected = !!Read;
-
-	// BuildId
-	Packet >> SessionSettings.BuildUniqueId;
+	int32 Flags = 0;
+	Packet >> TheiaCompact(SessionSettings.NumPublicConnections)
+		>> TheiaCompact(SessionSettings.NumPrivateConnections)
+		>> TheiaCompact(Flags)
+		>> TheiaCompact(SessionSettings.BuildUniqueId);
+	// The bools come packed, same bit order as AppendSessionSettingsToPacket
+	SessionSettings.bShouldAdvertise = !!(Flags & (1 << 0));
+	SessionSettings.bIsLANMatch = !!(Flags & (1 << 1));
+	SessionSettings.bIsDedicated = !!(Flags & (1 << 2));
+	SessionSettings.bUsesStats = !!(Flags & (1 << 3));
+	SessionSettings.bAllowJoinInProgress = !!(Flags & (1 << 4));
+	SessionSettings.bAllowInvites = !!(Flags & (1 << 5));
+	SessionSettings.bUsesPresence = !!(Flags & (1 << 6));
+	SessionSettings.bAllowJoinViaPresence = !!(Flags & (1 << 7));
+	SessionSettings.bAllowJoinViaPresenceFriendsOnly = !!(Flags & (1 << 8));
+	SessionSettings.bAntiCheatProtected = !!(Flags & (1 << 9));
+
+	uint16 SettingsLength = 0;
+	Packet >> SettingsLength;
+	if (Packet.HasOverflow() || SettingsLength > Packet.GetBytesLeft())
+	{
+		Packet.MarkMalformed();
+		return;
+	}
+
+	if (PendingSessionInfo != NULL)
+	{
+		// One copy into the arena now instead of a map entry, name and value per setting, see DecodeSearchResultSettings
+		uint8* PendingSettings = GetSearchArena().AllocateBytes(SettingsLength);
+		Packet.ReadBinary(PendingSettings, SettingsLength);
+		PendingSessionInfo->PendingSettings = PendingSettings;
+		PendingSessionInfo->PendingSettingsLength = SettingsLength;
+		PendingSessionInfo->bHasLazySettings = true;
+		return;
+	}
+
+	const int32 SettingsStart = Packet.GetReadOffset();
+	ReadAdvertisedSettingsFromPacket(Packet, SessionSettings);
+	if (!Packet.HasOverflow() && Packet.GetReadOffset() - SettingsStart != SettingsLength)
+	{
+		SessionSettings.Settings.Empty();
+		Packet.MarkMalformed();
+	}
+}
 
+void FOnlineSessionTheia::ReadAdvertisedSettingsFromPacket(FNboSerializeFromBufferTheia& Packet, FOnlineSessionSettings& SessionSettings)
+{
 	// Now read the contexts and properties from the settings class
 	int32 NumAdvertisedProperties = 0;
 	// First, read the number of advertised properties involved, so we can presize the array
-	Packet >> NumAdvertisedProperties;
+	Packet >> TheiaCompact(NumAdvertisedProperties);
 	if (Packet.HasOverflow() == false)
 	{
+		// One allocation for the map, every setting takes at least a byte so a bogus count can't ask for much
+		SessionSettings.Settings.Reserve(FMath::Clamp(NumAdvertisedProperties, 0, Packet.GetBytesLeft()));
 		FName Key;
 		// Now read each context individually
 		for (int32 Index = 0;
@@ -1247,8 +1496,8 @@ void FOnlineSessionTheia::ReadSettingsFromPacket(FNboSerializeFromBufferTheia& P
 			Index++)
 		{
 			FOnlineSessionSetting Setting;
-			Packet >> Key;
-			Packet >> Setting;
+			Packet >> TheiaCompact(Key);
+			Packet >> TheiaCompact(Setting);
 			SessionSettings.Set(Key, Setting);
 
 #if DEBUG_LAN_BEACON
@@ -1265,37 +1514,434 @@ void FOnlineSessionTheia::ReadSettingsFromPacket(FNboSerializeFromBufferTheia& P
 	}
 }
 
-void FOnlineSessionTheia::OnValidResponsePacketReceived(uint8* PacketData, int32 PacketLength)
+/**
+ * Parses a host given as "ipv4", "ipv4:port", "ipv6" or "[ipv6]:port"
+ *
+ * @return false if the address or port is not valid
+ */
+static bool ParseHostEndpoint(const FString& HostString, int32 DefaultPort, FTheiaHostEndpoint& OutHost)
 {
-	// Create an object that we'll copy the data to
-	FOnlineSessionSettings NewServer;
-	if (CurrentSessionSearch.IsValid())
+	FString AddrString = HostString.Trim().TrimTrailing();
+	int32 Port = DefaultPort;
+	FString IpString;
+	FString PortString;
+	if (AddrString.StartsWith(TEXT("[")))
+	{
+		if (!AddrString.Mid(1).Split(TEXT("]"), &IpString, &PortString))
+		{
+			return false;
+		}
+		AddrString = IpString;
+		if (PortString.StartsWith(TEXT(":")))
+		{
+			Port = FCString::Atoi(*PortString.Mid(1));
+		}
+	}
+	// A bare IPv6 address has several colons, only IPv4 takes a single one before the port
+	else if (AddrString.Split(TEXT(":"), &IpString, &PortString) && !PortString.Contains(TEXT(":")))
+	{
+		AddrString = IpString;
+		Port = FCString::Atoi(*PortString);
+	}
+
+	bool bIsValid = false;
+	ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr()->SetIp(*AddrString, bIsValid);
+	if (!bIsValid || Port <= 0 || Port > 65535)
+	{
+		return false;
+	}
+	OutHost = FTheiaHostEndpoint(AddrString, Port);
+	return true;
+}
+
+/**
+ * Reads just the session id from a serialized session, skipping what AppendSessionToPacket writes before it
+ *
+ * @return false if the session is too short to hold an id
+ */
+static bool PeekSessionId(uint8* SessionData, int32 SessionLength, FString& OutSessionId)
+{
+	FNboSerializeFromBufferTheia Packet(SessionData, SessionLength);
+	FUniqueNetIdString OwningUserId;
+	FString OwningUserName;
+	int32 NumOpenPrivateConnections = 0;
+	int32 NumOpenPublicConnections = 0;
+	Packet >> OwningUserId
+		>> TheiaCompact(OwningUserName)
+		>> TheiaCompact(NumOpenPrivateConnections)
+		>> TheiaCompact(NumOpenPublicConnections)
+		>> TheiaCompact(OutSessionId);
+	return !Packet.HasOverflow();
+}
+
+void FOnlineSessionTheia::OnValidResponsePacketReceived(uint8* PacketData, int32 PacketLength, const FInternetAddr& FromAddr)
+{
+	if (!CurrentSessionSearch.IsValid())
+	{
+		UE_LOG_ONLINE(Warning, TEXT("Failed to create new online game settings object"));
+		return;
+	}
+
+	// this is not a correct ping, but better than nothing. Measured from the last query
+	// sent, late answers to an earlier one were already seen and get dropped below
+	const int32 PingInMs = static_cast<int32>((FPlatformTime::Seconds() - TheiaSessionManager.GetQuerySentTime()) * 1000);
+
+	const int32 NumSessions = PacketLength >= THEIA_RESPONSE_COUNT_SIZE ? PacketData[0] : 0;
+	int32 Offset = THEIA_RESPONSE_COUNT_SIZE;
+	// Walk the packed sessions, each one is read in place behind its length prefix
+	for (int32 SessionIndex = 0; SessionIndex < NumSessions; SessionIndex++)
 	{
-		// Add space in the search results array
-		FOnlineSessionSearchResult* NewResult = new (CurrentSessionSearch->SearchResults) FOnlineSessionSearchResult();
-		// this is not a correct ping, but better than nothing
-		NewResult->PingInMs = static_cast<int32>((FPlatformTime::Seconds() - SessionSearchStartInSeconds) * 1000);
+		if (Offset + THEIA_RESPONSE_ENTRY_HEADER_SIZE > PacketLength)
+		{
+			break;
+		}
+		const int32 EntryHeader = (PacketData[Offset] << 8) | PacketData[Offset + 1];
+		const int32 EntryLength = EntryHeader & THEIA_RESPONSE_LENGTH_MASK;
+		Offset += THEIA_RESPONSE_ENTRY_HEADER_SIZE;
+		if (Offset + EntryLength > PacketLength)
+		{
+			UE_LOG_ONLINE(Warning, TEXT("Truncated session %d of %d in LAN response"), SessionIndex, NumSessions);
+			break;
+		}
 
-		FOnlineSession* NewSession = &NewResult->Session;
+		// Every session in this response shares its ping, so a full search ranked by ping can skip them all unread
+		const TArray<FOnlineSessionSearchResult>& SearchResults = CurrentSessionSearch->SearchResults;
+		const int32 MaxSearchResults = CurrentSessionSearch->MaxSearchResults;
+		if (!SearchResultComparator && MaxSearchResults > 0 && SearchResults.Num() >= MaxSearchResults && PingInMs >= SearchResults.HeapTop().PingInMs)
+		{
+			break;
+		}
+
+		uint8* SessionData = &PacketData[Offset];
+		int32 SessionLength = EntryLength;
+		if (EntryHeader & THEIA_RESPONSE_UNCHANGED_FLAG)
+		{
+			AddUnchangedSearchResult(SessionData, SessionLength, PingInMs);
+			Offset += EntryLength;
+			continue;
+		}
+		if (EntryHeader & THEIA_RESPONSE_COMPRESSED_FLAG)
+		{
+			if (!FTheiaCompression::Decompress(SessionData, EntryLength, DecompressedSession))
+			{
+				UE_LOG_ONLINE(Warning, TEXT("Malformed compressed session %d of %d in LAN response"), SessionIndex, NumSessions);
+				Offset += EntryLength;
+				continue;
+			}
+			SessionData = DecompressedSession.GetData();
+			SessionLength = DecompressedSession.Num();
+		}
+
+		// Hosts answer each retransmitted query, only keep their first answer
+		FString SessionId;
+		if (!PeekSessionId(SessionData, SessionLength, SessionId) || SeenSearchSessionIds.Contains(SessionId))
+		{
+			Offset += EntryLength;
+			continue;
+		}
+		SeenSearchSessionIds.Add(SessionId);
+
+		FOnlineSessionSearchResult NewResult;
+		NewResult.PingInMs = PingInMs;
 
 		// Prepare to read data from the packet
-		FNboSerializeFromBufferTheia Packet(PacketData, PacketLength);
-		
-		ReadSessionFromPacket(Packet, NewSession);
+		FNboSerializeFromBufferTheia Packet(SessionData, SessionLength);
+		ReadSessionFromPacket(Packet, &NewResult.Session);
+		const uint32 Version = Packet.ReadVarUInt();
+		if (!Packet.HasOverflow())
+		{
+			if (!TheiaSessionManager.IsLANMatch)
+			{
+				// Hosts advertise their local address, join through the one that answered instead.
+				// A host listed under both families answers both queries, the faster answer is kept
+				FOnlineSessionInfoTheia* SessionInfo = (FOnlineSessionInfoTheia*)NewResult.Session.SessionInfo.Get();
+				const int32 GamePort = SessionInfo->HostAddr->GetPort();
+				FTheiaBeacon::CopyAddr(*SessionInfo->HostAddr, FromAddr);
+				SessionInfo->HostAddr->SetPort(GamePort);
+			}
+			if (NextKnownSearchResults.Num() < THEIA_QUERY_MAX_KNOWN_SESSIONS)
+			{
+				FTheiaKnownSearchResult& Known = NextKnownSearchResults.Add(SessionId);
+				Known.Version = Version;
+				Known.Result = NewResult;
+			}
+			AddSearchResult(MoveTemp(NewResult));
+		}
+		else
+		{
+			UE_LOG_ONLINE(Warning, TEXT("Malformed session %d of %d in LAN response"), SessionIndex, NumSessions);
+		}
+
+		Offset += EntryLength;
+	}
+
+	// NOTE: listeners are notified once per tick, see NotifyNewSearchResults
+}
 
-		// NOTE: we don't notify until the timeout happens
+bool FOnlineSessionTheia::Exec(UWorld* InWorld, const TCHAR* Cmd, FOutputDevice& Ar)
+{
+	if (FParse::Command(&Cmd, TEXT("BENCHCOMPRESSION")))
+	{
+		const FString IterationsText = FParse::Token(Cmd, false);
+		const int32 Iterations = IterationsText.IsEmpty() ? 1000 : FCString::Atoi(*IterationsText);
+		BenchmarkCompression(FMath::Max(Iterations, 1), Ar);
+		return true;
+	}
+	if (FParse::Command(&Cmd, TEXT("BENCHHEADER")))
+	{
+		const FString IterationsText = FParse::Token(Cmd, false);
+		const int32 Iterations = IterationsText.IsEmpty() ? 100000 : FCString::Atoi(*IterationsText);
+		BenchmarkHeaderValidation(FMath::Max(Iterations, 1), Ar);
+		return true;
+	}
+	return false;
+}
+
+void FOnlineSessionTheia::BenchmarkCompression(int32 Iterations, FOutputDevice& Ar)
+{
+	TArray<TArray<uint8>> Payloads;
+	{
+		FScopeLock ScopeLock(&SessionLock);
+		for (int32 SessionIndex = 0; SessionIndex < Sessions.Num(); SessionIndex++)
+		{
+			FNamedOnlineSession& Session = Sessions[SessionIndex];
+			if (ShouldAnswerQuery(Session) && GetResponsePayload(Session).Num() > 0)
+			{
+				Payloads.Add(GetResponsePayload(Session));
+			}
+		}
+	}
+
+	if (Payloads.Num() == 0)
+	{
+		// Nothing hosted, measure settings typical of a session instead
+		FOnlineSessionSettings SampleSettings;
+		SampleSettings.NumPublicConnections = 16;
+		SampleSettings.bShouldAdvertise = true;
+		SampleSettings.Set(SETTING_MAPNAME, FString(TEXT("/Game/Maps/Highlands")), EOnlineDataAdvertisementType::ViaOnlineService);
+		SampleSettings.Set(SETTING_GAMEMODE, FString(TEXT("/Game/Blueprints/GameModes/TeamDeathmatch")), EOnlineDataAdvertisementType::ViaOnlineService);
+		SampleSettings.Set(SETTING_REGION, FString(TEXT("eu-west")), EOnlineDataAdvertisementType::ViaOnlineService);
+		SampleSettings.Set(SETTING_NUMBOTS, 4, EOnlineDataAdvertisementType::ViaOnlineService);
+		SampleSettings.Set(FName(TEXT("Mutators")), FString(TEXT("FriendlyFire Spectators TimeLimit=20 ScoreLimit=50")), EOnlineDataAdvertisementType::ViaOnlineService);
+		SampleSettings.Set(FName(TEXT("Ranked")), true, EOnlineDataAdvertisementType::ViaOnlineService);
+
+		FNboSerializeToBufferTheia Packet(TheiaSessionManager.GetMaxFragmentedSessionSize());
+		AppendSessionSettingsToPacket(Packet, &SampleSettings);
+		if (Packet.HasOverflow())
+		{
+			return;
+		}
+		Payloads[Payloads.AddDefaulted()].Append((uint8*)Packet, Packet.GetByteCount());
+	}
+
+	int32 PlainBytes = 0;
+	int32 CompressedBytes = 0;
+	double CompressSeconds = 0.0;
+	double DecompressSeconds = 0.0;
+	TArray<uint8> Compressed;
+	TArray<uint8> Decompressed;
+	for (const TArray<uint8>& Payload : Payloads)
+	{
+		const double CompressStart = FPlatformTime::Seconds();
+		for (int32 Iteration = 0; Iteration < Iterations; Iteration++)
+		{
+			FTheiaCompression::Compress(Payload.GetData(), Payload.Num(), Compressed);
+		}
+		const double DecompressStart = FPlatformTime::Seconds();
+		for (int32 Iteration = 0; Iteration < Iterations; Iteration++)
+		{
+			FTheiaCompression::Decompress(Compressed.GetData(), Compressed.Num(), Decompressed);
+		}
+		CompressSeconds += DecompressStart - CompressStart;
+		DecompressSeconds += FPlatformTime::Seconds() - DecompressStart;
+
+		if (Decompressed != Payload)
+		{
+			Ar.Logf(TEXT("Session of %d bytes did not survive compression"), Payload.Num());
+		}
+		PlainBytes += Payload.Num();
+		CompressedBytes += Compressed.Num();
+	}
+
+	const double NumRuns = (double)Iterations * Payloads.Num();
+	Ar.Logf(TEXT("Theia compression: %d sessions, %d bytes plain, %d bytes compressed (%.1f%%), dictionary %08x"),
+		Payloads.Num(), PlainBytes, CompressedBytes, PlainBytes > 0 ? 100.0 * CompressedBytes / PlainBytes : 0.0, FTheiaCompression::GetDictionaryId());
+	Ar.Logf(TEXT("Theia compression: %.2f us to compress, %.2f us to decompress, per session"),
+		CompressSeconds * 1000000.0 / NumRuns, DecompressSeconds * 1000000.0 / NumRuns);
+}
+
+void FOnlineSessionTheia::AddUnchangedSearchResult(uint8* SessionData, int32 SessionLength, int32 PingInMs)
+{
+	FNboSerializeFromBufferTheia Packet(SessionData, SessionLength);
+	FUniqueNetIdString SessionId;
+	Packet >> SessionId;
+	const uint32 Version = Packet.ReadVarUInt();
+	if (Packet.HasOverflow() || SeenSearchSessionIds.Contains(SessionId.UniqueNetIdStr))
+	{
+		return;
+	}
+
+	const FTheiaKnownSearchResult* Known = KnownSearchResults.Find(SessionId.UniqueNetIdStr);
+	if (Known == NULL || Known->Version != Version)
+	{
+		// The key we listed collided with another session's, its full details never come
+		UE_LOG_ONLINE(Verbose, TEXT("Host sent unchanged for session %s version %u which we don't have"), *SessionId.UniqueNetIdStr, Version);
+		return;
+	}
+	SeenSearchSessionIds.Add(SessionId.UniqueNetIdStr);
+	if (NextKnownSearchResults.Num() < THEIA_QUERY_MAX_KNOWN_SESSIONS)
+	{
+		NextKnownSearchResults.Add(SessionId.UniqueNetIdStr, *Known);
+	}
+
+	// Everything but the ping is as the last search read it, including the address it was joined through
+	FOnlineSessionSearchResult NewResult = Known->Result;
+	NewResult.PingInMs = PingInMs;
+	AddSearchResult(MoveTemp(NewResult));
+}
+
+bool FOnlineSessionTheia::DecodeSearchResultSettings(FOnlineSession& Session)
+{
+	FOnlineSessionInfoTheia* SessionInfo = (FOnlineSessionInfoTheia*)Session.SessionInfo.Get();
+	if (SessionInfo == NULL || !SessionInfo->bHasLazySettings)
+	{
+		// Read right away, nothing left to decode
+		return true;
+	}
+
+	// Copies of a result share its session info, the settings are only decoded once into it
+	if (!SessionInfo->bAreLazySettingsDecoded)
+	{
+		FOnlineSessionSettings Decoded;
+		FNboSerializeFromBufferTheia Packet(const_cast<uint8*>(SessionInfo->PendingSettings), SessionInfo->PendingSettingsLength);
+		ReadAdvertisedSettingsFromPacket(Packet, Decoded);
+		// The same checks as ReadSettingsFromPacket makes when it decodes them right away
+		SessionInfo->bAreLazySettingsMalformed = Packet.HasOverflow() || Packet.GetReadOffset() != SessionInfo->PendingSettingsLength;
+		if (!SessionInfo->bAreLazySettingsMalformed)
+		{
+			SessionInfo->LazySettings = MoveTemp(Decoded.Settings);
+		}
+		SessionInfo->bAreLazySettingsDecoded = true;
+		SessionInfo->PendingSettings = NULL;
+		SessionInfo->PendingSettingsLength = 0;
+	}
+
+	if (SessionInfo->bAreLazySettingsMalformed)
+	{
+		return false;
+	}
+
+	// Each copy takes the settings it doesn't have yet, any game code set on it are kept
+	for (FSessionSettings::TConstIterator It(SessionInfo->LazySettings); It; ++It)
+	{
+		if (!Session.SessionSettings.Settings.Contains(It.Key()))
+		{
+			Session.SessionSettings.Settings.Add(It.Key(), It.Value());
+		}
+	}
+	return true;
+}
+
+bool FOnlineSessionTheia::DetachSearchResultFromArena(FOnlineSession& Session)
+{
+	const FOnlineSessionInfoTheia* ArenaSessionInfo = (const FOnlineSessionInfoTheia*)Session.SessionInfo.Get();
+	if (ArenaSessionInfo == NULL || !ArenaSessionInfo->bIsInSearchArena)
+	{
+		return true;
+	}
+
+	// The undecoded settings bytes are in the arena too
+	if (!DecodeSearchResultSettings(Session))
+	{
+		return false;
+	}
+
+	if (Session.OwningUserId.IsValid())
+	{
+		Session.OwningUserId = MakeShareable(new FUniqueNetIdString(*StaticCastSharedPtr<const FUniqueNetIdString>(Session.OwningUserId)));
+	}
+
+	// Only what a search result uses, the settings are on the session now
+	TSharedRef<FOnlineSessionInfoTheia> SessionInfo = MakeShareable(new FOnlineSessionInfoTheia());
+	SessionInfo->HostAddr = FTheiaBeacon::CloneAddr(*ArenaSessionInfo->HostAddr);
+	SessionInfo->SessionId = ArenaSessionInfo->SessionId;
+	Session.SessionInfo = SessionInfo;
+	return true;
+}
+
+void FOnlineSessionTheia::DecodeSearchResults(TArray<FOnlineSessionSearchResult>& SearchResults)
+{
+	const int32 NumDropped = SearchResults.RemoveAll([this](FOnlineSessionSearchResult& SearchResult)
+	{
+		return !DecodeSearchResultSettings(SearchResult.Session);
+	});
+	if (NumDropped > 0)
+	{
+		UE_LOG_ONLINE(Warning, TEXT("Dropped %d search results with malformed advertised settings"), NumDropped);
+	}
+}
+
+void FOnlineSessionTheia::AddSearchResult(FOnlineSessionSearchResult&& NewResult)
+{
+	// Custom rankings and streamed results see the settings right away
+	if ((SearchResultComparator || OnFindSessionsResultsReceivedDelegates.IsBound()) && !DecodeSearchResultSettings(NewResult.Session))
+	{
+		UE_LOG_ONLINE(Warning, TEXT("Dropping search result with malformed advertised settings"));
+		return;
+	}
+
+	TArray<FOnlineSessionSearchResult>& SearchResults = CurrentSessionSearch->SearchResults;
+	const int32 MaxSearchResults = CurrentSessionSearch->MaxSearchResults;
+	// Puts the worst result on top of the heap
+	auto IsWorse = [this](const FOnlineSessionSearchResult& A, const FOnlineSessionSearchResult& B)
+	{
+		return IsBetterSearchResult(B, A);
+	};
+
+	if (MaxSearchResults > 0 && SearchResults.Num() >= MaxSearchResults)
+	{
+		if (!IsBetterSearchResult(NewResult, SearchResults.HeapTop()))
+		{
+			return;
+		}
+		SearchResults.HeapPopDiscard(IsWorse, false);
+	}
+
+	if (OnFindSessionsResultsReceivedDelegates.IsBound())
+	{
+		PendingSearchResults.Add(NewResult);
+	}
+
+	if (MaxSearchResults > 0)
+	{
+		SearchResults.HeapPush(MoveTemp(NewResult), IsWorse);
 	}
 	else
 	{
-		UE_LOG_ONLINE(Warning, TEXT("Failed to create new online game settings object"));
+		SearchResults.Add(MoveTemp(NewResult));
 	}
 }
 
 uint32 FOnlineSessionTheia::FinalizeTheiaSearch()
 {
-	if (TheiaSessionManager.GetBeaconState() == ELanBeaconState::Searching)
+	// Only the search stops, a hosted session keeps answering queries
+	if (TheiaSessionManager.IsSearching())
 	{
-		TheiaSessionManager.StopTheiaSession();
+		TheiaSessionManager.StopSearching();
+	}
+
+	if (SearchArena.IsValid())
+	{
+		UE_LOG_ONLINE(Verbose, TEXT("Search results took %d allocations (%d bytes) from %d arena blocks"),
+			SearchArena->GetNumAllocations(), SearchArena->GetNumBytesAllocated(), SearchArena->GetNumBlocks());
+		// Owner ids, session infos and settings bytes were a heap allocation apiece before the arena, now only its blocks are
+		if (NumSearchArenaResults > 0)
+		{
+			UE_LOG_ONLINE(Verbose, TEXT("Heap allocations per search result for its arena objects: %.2f without the arena, %.2f with it (%d results)"),
+				(float)SearchArena->GetNumAllocations() / NumSearchArenaResults, (float)SearchArena->GetNumBlocks() / NumSearchArenaResults, NumSearchArenaResults);
+		}
+		// The results hold on to the arena for as long as they need it
+		SearchArena.Reset();
 	}
 
 	return UpdateTheiaStatus();
@@ -1305,15 +1951,46 @@ void FOnlineSessionTheia::OnTheiaSearchTimeout()
 {
 	FinalizeTheiaSearch();
 
+	// Stream whatever arrived this tick before the search completes
+	const bool bHadSearch = CurrentSessionSearch.IsValid();
+	NotifyNewSearchResults();
+	if (bHadSearch && !CurrentSessionSearch.IsValid())
+	{
+		// Canceled by a results received listener, which already triggered its own delegate
+		return;
+	}
+
 	if (CurrentSessionSearch.IsValid())
 	{
+		// Only the results that made the cut get their settings decoded, the game may sort by them
+		DecodeSearchResults(CurrentSessionSearch->SearchResults);
 		if (CurrentSessionSearch->SearchResults.Num() > 0)
 		{
+			if (CurrentSessionSearch->MaxSearchResults > 0)
+			{
+				// At most MaxSearchResults to sort, best first
+				CurrentSessionSearch->SearchResults.HeapSort([this](const FOnlineSessionSearchResult& A, const FOnlineSessionSearchResult& B)
+				{
+					return IsBetterSearchResult(A, B);
+				});
+			}
 			// Allow game code to sort the servers
 			CurrentSessionSearch->SortSearchResults();
 		}
 		CurrentSessionSearch->SearchState = EOnlineAsyncTaskState::Done;
 
+		// Only a search that ran its course knows which sessions are still around.
+		// Kept across searches, so they must not hold on to this search's arena
+		for (TMap<FString, FTheiaKnownSearchResult>::TIterator It(NextKnownSearchResults); It; ++It)
+		{
+			if (!DetachSearchResultFromArena(It.Value().Result.Session))
+			{
+				It.RemoveCurrent();
+			}
+		}
+		KnownSearchResults = MoveTemp(NextKnownSearchResults);
+		NextKnownSearchResults.Reset();
+
 		CurrentSessionSearch = NULL;
 	}
 
@@ -1375,42 +2052,147 @@ bool FOnlineSessionTheia::IsHost(const FNamedOnlineSession& Session) const
 	return (UserId.IsValid() && (*UserId == *Session.OwningUserId));
 }
 
-//*SetHostPort Fetches Host Port from QuerrySettings and sets it to be connected to
-void FOnlineSessionTheia::SetHostPort( const TSharedRef<FOnlineSessionSearch>& SearchSettings)
+bool FOnlineSessionTheia::SetSearchHosts(const TSharedRef<FOnlineSessionSearch>& SearchSettings)
+{
+	TArray<FTheiaHostEndpoint>& SearchHosts = TheiaSessionManager.SearchHosts;
+	SearchHosts.Reset();
+
+	int32 DefaultPort = THEIA_DEFAULT_SEARCH_HOST_PORT;
+	SearchSettings->QuerySettings.Get(FName(TEXT("HostSessionPort")), DefaultPort);
+
+	FString HostList;
+	TArray<FString> HostStrings;
+	SearchSettings->QuerySettings.Get(FName(TEXT("HostSessionAddr")), HostList);
+	HostList.ParseIntoArray(HostStrings, TEXT(","), true);
+	if (HostStrings.Num() == 0)
+	{
+		GConfig->GetArray(TEXT("LANSession"), TEXT("SearchHosts"), HostStrings, GEngineIni);
+	}
+
+	for (const FString& HostString : HostStrings)
+	{
+		FTheiaHostEndpoint Host;
+		if (ParseHostEndpoint(HostString, DefaultPort, Host))
+		{
+			SearchHosts.Add(Host);
+		}
+		else
+		{
+			UE_LOG_ONLINE(Warning, TEXT("Ignoring invalid search host '%s'"), *HostString);
+		}
+	}
+
+	UE_LOG_ONLINE(Verbose, TEXT("Online search querying %d hosts"), SearchHosts.Num());
+	return SearchHosts.Num() > 0;
+}
+
+/**
+ * The serializer based header check used before FTheiaBeaconHeaderCodec, kept as the baseline for BenchmarkHeaderValidation
+ */
+static ETheiaBeaconPacketKind::Type ClassifyHeaderWithSerializer(const uint8* Packet, int32 Length, int32 GameUniqueId, int32 PlatformMask, uint64 ExpectedNonce)
 {
-	int32 HostPort = 0;
-	SearchSettings->QuerySettings.Get("HostSessionPortPort", HostPort);
-	UE_LOG(LogOnline, VeryVerbose, TEXT("SetHostPort: Port Passed in from blueprint %u "), HostPort);
-	TheiaSessionManager.HostSessionPort = HostPort;
+	if (Length < LAN_BEACON_PACKET_HEADER_SIZE)
+	{
+		return ETheiaBeaconPacketKind::Invalid;
+	}
+
+	FNboSerializeFromBuffer PacketReader(Packet, Length);
+	uint8 Version = 0;
+	uint8 Platform = 255;
+	int32 GameId = -1;
+	uint8 Type1 = 0;
+	uint8 Type2 = 0;
+	uint64 Nonce = 0;
+	PacketReader >> Version >> Platform >> GameId >> Type1 >> Type2 >> Nonce;
+	if (Version != LAN_BEACON_PACKET_VERSION || (Platform & PlatformMask) == 0 || GameId != GameUniqueId)
+	{
+		return ETheiaBeaconPacketKind::Invalid;
+	}
+	if (Type1 == LAN_SERVER_QUERY1 && Type2 == LAN_SERVER_QUERY2)
+	{
+		return ETheiaBeaconPacketKind::Query;
+	}
+	if (Length == LAN_BEACON_PACKET_HEADER_SIZE || Nonce != ExpectedNonce)
+	{
+		return ETheiaBeaconPacketKind::Invalid;
+	}
+	if (Type1 == LAN_SERVER_RESPONSE1 && Type2 == LAN_SERVER_RESPONSE2)
+	{
+		return ETheiaBeaconPacketKind::Response;
+	}
+	return (Type1 == LAN_SERVER_FRAGMENT1 && Type2 == LAN_SERVER_FRAGMENT2) ? ETheiaBeaconPacketKind::Fragment : ETheiaBeaconPacketKind::Invalid;
 }
 
-//SetHostAddr fetches the Host address passed in from blueprint and converts it from string into Hex to be used
-//Not Currently Working
-void FOnlineSessionTheia::SetHostAddr(const TSharedRef<FOnlineSessionSearch>& SearchSettings)
+void FOnlineSessionTheia::BenchmarkHeaderValidation(int32 Iterations, FOutputDevice& Ar)
 {
-/*
-	FString HostAddr;
-	TArray<FString> IpArray = {};
+	const int32 GameUniqueId = TheiaSessionManager.TheiaGameUniqueId;
+	const int32 PlatformMask = TheiaSessionManager.TheiaPacketPlatformMask;
+	const uint64 OurNonce = 0x0123456789abcdefULL;
+	const uint64 OtherNonce = 0xfedcba9876543210ULL;
+
+	// What a busy LAN delivers: queries, answers to us and to others, other games and older versions
+	TArray<TArray<uint8>> Packets;
+	for (int32 SampleIndex = 0; SampleIndex < 8; SampleIndex++)
+	{
+		FNboSerializeToBufferTheia Packet(LAN_BEACON_MAX_PACKET_SIZE);
+		if (SampleIndex % 4 == 0)
+		{
+			TheiaSessionManager.CreateClientQueryPacket(Packet, OtherNonce + SampleIndex);
+		}
+		else
+		{
+			TheiaSessionManager.CreateHostResponsePacket(Packet, SampleIndex % 4 == 3 ? OtherNonce : OurNonce);
+		}
+		Packet << (uint8)1;
+		TArray<uint8>& Sample = Packets[Packets.AddDefaulted()];
+		Sample.Append((uint8*)Packet, Packet.GetByteCount());
+		if (SampleIndex == 2)
+		{
+			Sample[LAN_BEACON_PACKETTYPE1_OFFSET] = LAN_SERVER_FRAGMENT1;
+			Sample[LAN_BEACON_PACKETTYPE2_OFFSET] = LAN_SERVER_FRAGMENT2;
+		}
+		else if (SampleIndex == 5)
+		{
+			Sample[LAN_BEACON_GAMEID_OFFSET + 3] ^= 0xff;
+		}
+		else if (SampleIndex == 6)
+		{
+			Sample[LAN_BEACON_VER_OFFSET] = (uint8)(LAN_BEACON_PACKET_VERSION - 1);
+		}
+	}
 
-	SearchSettings->QuerySettings.Get("HostSessionAddr", HostAddr);
-	UE_LOG(LogOnline, VeryVerbose , TEXT("SetHostAddr: Addr Passed in from blueprint %s "), *HostAddr);
-	const TCHAR Delim = '.';
-	HostAddr.ParseIntoArray(IpArray, TEXT("."), false);
-	uint32 ConvertedHostAddr;
-	for (int i = 0; i < IpArray.Num(); i++)
+	const FTheiaBeaconHeaderCodec& Codec = TheiaSessionManager.GetHeaderCodec();
+	int32 NumValid = 0;
+	for (const TArray<uint8>& Packet : Packets)
 	{
+		NumValid += Codec.Classify(Packet.GetData(), Packet.Num(), OurNonce) != ETheiaBeaconPacketKind::Invalid ? 1 : 0;
 	}
 
-	if (IpArray.Num() == 4)
+	// Summed so neither loop can be optimized away, and to compare the results
+	int32 SerializerSum = 0;
+	const double SerializerStart = FPlatformTime::Seconds();
+	for (int32 Iteration = 0; Iteration < Iterations; Iteration++)
 	{
-		FIPv4Address IPv4Address(FCString::Atoi(*IpArray[0]), FCString::Atoi(*IpArray[1]), FCString::Atoi(*IpArray[2]), FCString::Atoi(*IpArray[3]));
-		ConvertedHostAddr = IPv4Address.Value;
+		for (const TArray<uint8>& Packet : Packets)
+		{
+			SerializerSum += ClassifyHeaderWithSerializer(Packet.GetData(), Packet.Num(), GameUniqueId, PlatformMask, OurNonce);
+		}
 	}
-	else
+	int32 CodecSum = 0;
+	const double CodecStart = FPlatformTime::Seconds();
+	for (int32 Iteration = 0; Iteration < Iterations; Iteration++)
 	{
-		UE_LOG(LogOnline, VeryVerbose, TEXT("SetHostAddr: Ipaddress not long enough"));
+		for (const TArray<uint8>& Packet : Packets)
+		{
+			CodecSum += Codec.Classify(Packet.GetData(), Packet.Num(), OurNonce);
+		}
 	}
-	UE_LOG(LogOnline, VeryVerbose, TEXT("SetHostAddr: Host Address is now %u"), ConvertedHostAddr);
-	TheiaSessionManager.HostSessionAddr = ConvertedHostAddr;
-	*/
-}
\ No newline at end of file
+	const double CodecSeconds = FPlatformTime::Seconds() - CodecStart;
+	const double SerializerSeconds = CodecStart - SerializerStart;
+
+	const double NumRuns = (double)Iterations * Packets.Num();
+	Ar.Logf(TEXT("Theia header validation: %d sample headers, %d valid, checks %s"),
+		Packets.Num(), NumValid, CodecSum == SerializerSum ? TEXT("agree") : TEXT("DISAGREE"));
+	Ar.Logf(TEXT("Theia header validation: %.2f ns with the serializer, %.2f ns with the header codec, per header"),
+		SerializerSeconds * 1000000000.0 / NumRuns, CodecSeconds * 1000000000.0 / NumRuns);
+}
@@ -7,11 +7,25 @@
 #include "Misc/ScopeLock.h"
 #include "OnlineSessionSettings.h"
 #include "Interfaces/OnlineSessionInterface.h"
+#include "OnlineSessionDelegatesTheia.h"
 #include "OnlineSubsystemTheiaPackage.h"
 #include "TheiaBeacon.h"
+#include "TheiaSearchArena.h"
 
 class FOnlineSubsystemTheia;
 
+/**
+ * A search result kept for the next search, whose query lists it so hosts only
+ * send back its id while its version still matches
+ */
+struct FTheiaKnownSearchResult
+{
+	/** Version the host sent with the session */
+	uint32 Version;
+	/** The result as the search that read it produced it */
+	FOnlineSessionSearchResult Result;
+};
+
 /**
  * Interface definition for the online services session services 
  * Session services are defined as anything related managing a session 
@@ -27,10 +41,18 @@ private:
 	/** Handles advertising sessions over LAN and client searches */
 	FTheiaSession TheiaSessionManager;
 
+	/** Serial handed to the next rebuilt session response payload */
+	uint32 NextResponsePayloadSerial;
+
+	/** Serials of the payloads last handed to the beacon thread, in publish order */
+	TArray<uint32> PublishedPayloadSerials;
+
 	/** Hidden on purpose */
 	FOnlineSessionTheia() :
 		TheiaSubsystem(NULL),
-		CurrentSessionSearch(NULL)
+		NextResponsePayloadSerial(0),
+		CurrentSessionSearch(NULL),
+		bKnownSearchResultsAreLAN(false)
 	{}
 
 	/**
@@ -61,6 +83,43 @@ private:
 	 */
 	bool IsSessionJoinable( const FNamedOnlineSession& Session) const;
 
+	/**
+	 * Determines whether this particular session should answer client queries
+	 *
+	 * @return true if yes
+	 */
+	bool ShouldAnswerQuery(const FNamedOnlineSession& Session) const;
+
+	/**
+	 * Hands the cached payload of every session that answers queries to the beacon
+	 * thread, which builds responses from it without touching the session list.
+	 * Nothing is rebuilt or copied unless a session is dirty or the set of answering sessions changed
+	 */
+	void PublishHostedResponsePayloads();
+
+	/**
+	 * Returns the serialized session details sent in answer to queries, rebuilding
+	 * them first if the session changed since they were last built
+	 *
+	 * @param Session the hosted session to get the payload for
+	 *
+	 * @return the cached payload, empty if the session does not fit in a packet
+	 */
+	const TArray<uint8>& GetResponsePayload(FNamedOnlineSession& Session);
+
+	/**
+	 * Marks the cached response payload of a session as stale
+	 *
+	 * @param Session the session that changed
+	 */
+	void InvalidateResponsePayload(FNamedOnlineSession& Session);
+
+	/**
+	 * Picks up net driver port changes once per tick instead of once per query,
+	 * invalidating the payloads of sessions whose advertised port moved
+	 */
+	void RefreshHostedSessionPorts();
+
 	/**
 	 * Updates the status of LAN session (creates it if needed, shuts down if not)
 	 * 
@@ -126,8 +185,17 @@ private:
 	 *
 	 * @param Packet the reader object that will read the data
 	 * @param SessionSettings the session settings to copy the data to
+	 * @param PendingSessionInfo if set, receives the advertised settings undecoded instead of SessionSettings
 	 */
-	void ReadSettingsFromPacket(class FNboSerializeFromBufferTheia& Packet, FOnlineSessionSettings& SessionSettings);
+	void ReadSettingsFromPacket(class FNboSerializeFromBufferTheia& Packet, FOnlineSessionSettings& SessionSettings, class FOnlineSessionInfoTheia* PendingSessionInfo);
+
+	/**
+	 * Reads the advertised settings, the part of the session settings clients may keep undecoded
+	 *
+	 * @param Packet the reader object that will read the data
+	 * @param SessionSettings the session settings to add the settings to
+	 */
+	void ReadAdvertisedSettingsFromPacket(class FNboSerializeFromBufferTheia& Packet, FOnlineSessionSettings& SessionSettings);
 
 	/**
 	 * Delegate triggered when the LAN beacon has detected a valid client request has been received
@@ -143,14 +211,56 @@ private:
 	 *
 	 * @param PacketData packet data sent by the requesting client with header information removed
 	 * @param PacketLength length of the packet not including header size
+	 * @param FromAddr the address of the host that sent the response
 	 */
-	void OnValidResponsePacketReceived(uint8* PacketData, int32 PacketLength);
+	void OnValidResponsePacketReceived(uint8* PacketData, int32 PacketLength, const FInternetAddr& FromAddr);
 
 	/**
 	 * Delegate triggered when the LAN beacon has finished searching (some time after last received host packet)
 	 */
 	void OnTheiaSearchTimeout();
 
+	/**
+	 * Hands the search results received since the last call to the results received delegates
+	 */
+	void NotifyNewSearchResults();
+
+	/**
+	 * Decodes the advertised settings of every result, dropping those that are malformed
+	 *
+	 * @param SearchResults the results to decode
+	 */
+	void DecodeSearchResults(TArray<FOnlineSessionSearchResult>& SearchResults);
+
+	/**
+	 * Adds a result to the current search. When the search has a MaxSearchResults
+	 * limit the results are kept as a heap with the worst one on top, so a full
+	 * search only has to compare against that one to accept or reject a result
+	 *
+	 * @param NewResult the result read from a host response
+	 */
+	void AddSearchResult(FOnlineSessionSearchResult&& NewResult);
+
+	/**
+	 * Adds the copy the last search read of a session whose host answered that it is unchanged
+	 *
+	 * @param SessionData the session id and version sent by the host
+	 * @param SessionLength the number of bytes in SessionData
+	 * @param PingInMs the ping of the response it came in
+	 */
+	void AddUnchangedSearchResult(uint8* SessionData, int32 SessionLength, int32 PingInMs);
+
+	/**
+	 * @return true if A should be kept over B, by SearchResultComparator or lowest ping
+	 */
+	bool IsBetterSearchResult(const FOnlineSessionSearchResult& A, const FOnlineSessionSearchResult& B) const
+	{
+		return SearchResultComparator ? SearchResultComparator(A, B) : A.PingInMs < B.PingInMs;
+	}
+
+	/** Ranks results for MaxSearchResults, unset ranks by ping */
+	FOnlineSearchResultComparator SearchResultComparator;
+
 	/**
 	 * Attempt to set the host port in the session info based on the actual port the netdriver is using.
 	 */
@@ -168,9 +278,34 @@ private:
 
 	int32 GetPort();
 
-	void SetHostPort(const TSharedRef<FOnlineSessionSearch>& SearchSettings);
+	/**
+	 * Fills in the hosts an online search queries. Taken from the "HostSessionAddr"
+	 * query setting ("addr[:port]" separated by commas, "HostSessionPort" being the
+	 * default port), otherwise from SearchHosts in the [LANSession] config section
+	 *
+	 * @param SearchSettings the search about to start
+	 *
+	 * @return false if neither names a valid host, the search can't start
+	 */
+	bool SetSearchHosts(const TSharedRef<FOnlineSessionSearch>& SearchSettings);
 
-	void SetHostAddr(const TSharedRef<FOnlineSessionSearch>& SearchSettings);
+	/**
+	 * Compresses and decompresses the hosted session payloads, or a sample session
+	 * when nothing is hosted, and reports the sizes and time taken per session
+	 *
+	 * @param Iterations times each payload is compressed and decompressed
+	 * @param Ar the device to report to
+	 */
+	void BenchmarkCompression(int32 Iterations, FOutputDevice& Ar);
+
+	/**
+	 * Checks a batch of sample packet headers with FTheiaBeaconHeaderCodec and with the
+	 * serializer based check it replaced, and reports the time taken per header
+	 *
+	 * @param Iterations times the batch is checked by each
+	 * @param Ar the device to report to
+	 */
+	void BenchmarkHeaderValidation(int32 Iterations, FOutputDevice& Ar);
 
 
 PACKAGE_SCOPE:
@@ -187,10 +322,58 @@ PACKAGE_SCOPE:
 	/** Current search start time. */
 	double SessionSearchStartInSeconds;
 
+	/** Results kept since the results received delegates last fired, only filled while they are bound */
+	TArray<FOnlineSessionSearchResult> PendingSearchResults;
+
+	/** Ids of the sessions the current search has already seen, hosts answer every retransmitted query */
+	TSet<FString> SeenSearchSessionIds;
+
+	/** Scratch space compressed sessions are inflated into before they are read */
+	TArray<uint8> DecompressedSession;
+
+	/** Backs the results of the current search, see FTheiaSearchArena */
+	TSharedPtr<FTheiaSearchArena> SearchArena;
+
+	/** Number of results read into SearchArena, for the allocations per result FinalizeTheiaSearch reports */
+	int32 NumSearchArenaResults;
+
+	/** @return the arena of the current search, started on first use */
+	FTheiaSearchArena& GetSearchArena()
+	{
+		if (!SearchArena.IsValid())
+		{
+			SearchArena = MakeShareable(new FTheiaSearchArena());
+			NumSearchArenaResults = 0;
+		}
+		return *SearchArena;
+	}
+
+	/**
+	 * Moves what a search result holds in the search arena to the heap, so keeping the
+	 * result doesn't keep the whole arena of its search alive. Decodes its settings first
+	 *
+	 * @param Session the session of the search result
+	 *
+	 * @return false if the settings are malformed, the result should be dropped
+	 */
+	bool DetachSearchResultFromArena(FOnlineSession& Session);
+
+	/** Results of the last completed search by session id, reused when a host answers that a session is unchanged */
+	TMap<FString, FTheiaKnownSearchResult> KnownSearchResults;
+
+	/** Results of the current search, they replace KnownSearchResults once it completes */
+	TMap<FString, FTheiaKnownSearchResult> NextKnownSearchResults;
+
+	/** Whether KnownSearchResults came from a LAN search, online results carry the address that answered instead */
+	bool bKnownSearchResultsAreLAN;
+
 	FOnlineSessionTheia(class FOnlineSubsystemTheia* InSubsystem) :
 		TheiaSubsystem(InSubsystem),
+		NextResponsePayloadSerial(0),
 		CurrentSessionSearch(NULL),
-		SessionSearchStartInSeconds(0)
+		SessionSearchStartInSeconds(0),
+		NumSearchArenaResults(0),
+		bKnownSearchResultsAreLAN(false)
 	{}
 
 	/**
@@ -198,6 +381,16 @@ PACKAGE_SCOPE:
 	 */
 	void Tick(float DeltaTime);
 
+	/**
+	 * Handles the session console commands, passed on by the subsystem:
+	 *
+	 *	THEIA BENCHCOMPRESSION [Iterations]	bytes on the wire and CPU cost of session compression (1000 iterations by default)
+	 *	THEIA BENCHHEADER [Iterations]		cost per packet of checking beacon headers, serializer against batch codec (100000 iterations by default)
+	 *
+	 * @return true if the command was handled
+	 */
+	bool Exec(UWorld* InWorld, const TCHAR* Cmd, FOutputDevice& Ar);
+
 	// IOnlineSession
 	class FNamedOnlineSession* AddNamedSession(FName SessionName, const FOnlineSessionSettings& SessionSettings) override
 	{
@@ -333,6 +526,31 @@ public:
 	virtual void UnregisterLocalPlayer(const FUniqueNetId& PlayerId, FName SessionName, const FOnUnregisterLocalPlayerCompleteDelegate& Delegate) override;
 	virtual int32 GetNumSessions() override;
 	virtual void DumpSessionState() override;
+
+	DEFINE_ONLINE_DELEGATE_ONE_PARAM(OnFindSessionsResultsReceived, const TArray<FOnlineSessionSearchResult>&);
+
+	/**
+	 * Sets how results are ranked when a search has a MaxSearchResults limit.
+	 * Pass an unset function to go back to ranking by ping
+	 *
+	 * @param InComparator returns true if its first argument should be kept over its second
+	 */
+	void SetSearchResultComparator(const FOnlineSearchResultComparator& InComparator)
+	{
+		SearchResultComparator = InComparator;
+	}
+
+	/**
+	 * Decodes the advertised settings of a search result read with bLazySearchResultSettings.
+	 * Done for every result before it reaches game code, only needed for results taken
+	 * from the search while it is still running. Game code gets at it through
+	 * FOnlineSubsystemTheia::DecodeSearchResultSettings
+	 *
+	 * @param Session the session of the search result
+	 *
+	 * @return false if the settings are malformed, the result should be dropped
+	 */
+	bool DecodeSearchResultSettings(FOnlineSession& Session);
 	
 
 };
@@ -17,6 +17,36 @@ IOnlineSessionPtr FOnlineSubsystemTheia::GetSessionInterface() const
 	return SessionInterface;
 }
 
+FDelegateHandle FOnlineSubsystemTheia::AddOnFindSessionsResultsReceivedDelegate_Handle(const FOnFindSessionsResultsReceivedDelegate& Delegate)
+{
+	if (SessionInterface.IsValid())
+	{
+		return SessionInterface->AddOnFindSessionsResultsReceivedDelegate_Handle(Delegate);
+	}
+	return FDelegateHandle();
+}
+
+void FOnlineSubsystemTheia::ClearOnFindSessionsResultsReceivedDelegate_Handle(FDelegateHandle& Handle)
+{
+	if (SessionInterface.IsValid())
+	{
+		SessionInterface->ClearOnFindSessionsResultsReceivedDelegate_Handle(Handle);
+	}
+}
+
+void FOnlineSubsystemTheia::SetSearchResultComparator(const FOnlineSearchResultComparator& Comparator)
+{
+	if (SessionInterface.IsValid())
+	{
+		SessionInterface->SetSearchResultComparator(Comparator);
+	}
+}
+
+bool FOnlineSubsystemTheia::DecodeSearchResultSettings(FOnlineSessionSearchResult& SearchResult)
+{
+	return !SessionInterface.IsValid() || SessionInterface->DecodeSearchResultSettings(SearchResult.Session);
+}
+
 IOnlineFriendsPtr FOnlineSubsystemTheia::GetFriendsInterface() const
 {
 	return nullptr;
@@ -238,6 +268,10 @@ bool FOnlineSubsystemTheia::Exec(UWorld* InWorld, const TCHAR* Cmd, FOutputDevic
 	{
 		return true;
 	}
+	if (FParse::Command(&Cmd, TEXT("THEIA")) && SessionInterface.IsValid())
+	{
+		return SessionInterface->Exec(InWorld, Cmd, Ar);
+	}
 	return false;
 }
 
@@ -7,6 +7,7 @@
 #include "OnlineSubsystemNames.h"
 #include "OnlineSubsystem.h"
 #include "OnlineSubsystemTheia.h"
+#include "TheiaBeaconPoller.h"
 
 IMPLEMENT_MODULE(FOnlineSubsystemTheiaModule, OnlineSubsystemTheia);
 
@@ -59,4 +60,6 @@ void FOnlineSubsystemTheiaModule::ShutdownModule()
 	
 	delete TheiaFactory;
 	TheiaFactory = NULL;
+
+	FTheiaBeaconPoller::TearDown();
 }
@@ -5,6 +5,7 @@
 #include "CoreMinimal.h"
 #include "OnlineSubsystemTypes.h"
 #include "IPAddress.h"
+#include "OnlineSessionSettings.h"
 
 class FOnlineSubsystemTheia;
 
@@ -41,6 +42,44 @@ PACKAGE_SCOPE:
 	TSharedPtr<class FInternetAddr> HostAddr;
 	/** Unique Id for this session */
 	FUniqueNetIdString SessionId;
+	/**
+	 * Advertised settings of a search result not decoded yet, see FOnlineSessionTheia::DecodeSearchResultSettings.
+	 * Lives in the search arena this session info was allocated from
+	 */
+	const uint8* PendingSettings;
+	/** Number of bytes at PendingSettings */
+	int32 PendingSettingsLength;
+	/** Set when the advertised settings were read with bLazySearchResultSettings, PendingSettings holds them until decoded */
+	bool bHasLazySettings;
+	/** Set once PendingSettings has been decoded into LazySettings, or found malformed */
+	bool bAreLazySettingsDecoded;
+	/** Set when PendingSettings failed the checks an eagerly read session goes through */
+	bool bAreLazySettingsMalformed;
+	/** The decoded advertised settings, shared by every copy of the search result */
+	FSessionSettings LazySettings;
+	/** Set when this session info and the search result's owner id live in a search arena */
+	bool bIsInSearchArena;
+
+	/** Serialized session details sent (after the header) in answer to every client query */
+	TArray<uint8> CachedResponsePayload;
+	/** CachedResponsePayload compressed for clients that accept it, empty when compression does not pay off */
+	TArray<uint8> CachedCompressedResponsePayload;
+	/** Just the session id and version, sent to clients that already have this version */
+	TArray<uint8> CachedUnchangedResponsePayload;
+	/** CachedResponsePayload with every setting key by name, for clients with a different setting key table */
+	TArray<uint8> CachedByNameResponsePayload;
+	/** Key clients list this version under, see FTheiaQueryFilters::MakeSessionVersionKey */
+	uint64 ResponseVersionKey;
+	/** Set when the session changed since CachedResponsePayload was built */
+	bool bIsResponsePayloadDirty;
+	/** Identifies the contents of CachedResponsePayload, changes on every rebuild. Sent as the session's version */
+	uint32 ResponsePayloadSerial;
+
+	/** Forces the response payload to be rebuilt before the next query is answered */
+	void InvalidateResponsePayload()
+	{
+		bIsResponsePayloadDirty = true;
+	}
 
 public:
 
@@ -7,17 +7,64 @@
 #include "SocketSubsystem.h"
 #include "Sockets.h"
 #include "NboSerializer.h"
+#include "HAL/RunnableThread.h"
+#include "TheiaBeaconThread.h"
+#include "TheiaBeaconPoller.h"
+#include "TheiaNativeSocket.h"
+#include "Interfaces/IPv4/IPv4Address.h"
+#include "Misc/Crc.h"
+
+void FTheiaBeacon::CopyAddr(FInternetAddr& Dest, const FInternetAddr& Source)
+{
+	uint32 Ip = 0;
+	Source.GetIp(Ip);
+	if (Ip != 0)
+	{
+		// IPv4, copied without allocating
+		Dest.SetIp(Ip);
+	}
+	else
+	{
+		// IPv6 addresses have no 32 bit form, go through their text form instead
+		bool bIsValid = false;
+		Dest.SetIp(*Source.ToString(false), bIsValid);
+	}
+	Dest.SetPort(Source.GetPort());
+}
+
+TSharedRef<FInternetAddr> FTheiaBeacon::CloneAddr(const FInternetAddr& Source)
+{
+	TSharedRef<FInternetAddr> Clone = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr();
+	CopyAddr(*Clone, Source);
+	return Clone;
+}
 
 /** Sets the broadcast address for this object */
-FTheiaBeacon::FTheiaBeacon(void) 
+FTheiaBeacon::FTheiaBeacon(int32 BatchSize)
 	: ListenSocket(NULL),
-	  SockAddr(ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr())
+	  SockAddr(ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr()),
+	  NumPendingSends(0),
+	  bUsesReadinessPolling(false),
+	  bIsReadable(false),
+	  RequestedPort(-1)
 {
+	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
+	// Allocate every slot up front so receiving and sending never allocate
+	BatchSize = FMath::Max(BatchSize, 1);
+	ReceiveRing.Reserve(BatchSize);
+	SendRing.Reserve(BatchSize);
+	for (int32 Index = 0; Index < BatchSize; Index++)
+	{
+		ReceiveRing.Emplace(SocketSubsystem->CreateInternetAddr());
+		SendRing.Emplace(SocketSubsystem->CreateInternetAddr());
+	}
 }
 
 /** Frees the broadcast socket */
 FTheiaBeacon::~FTheiaBeacon(void)
 {
+	// Make sure the poller is done with the socket before it goes away
+	DisableReadinessPolling();
 	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
 	SocketSubsystem->DestroySocket(ListenSocket);
 }
@@ -35,7 +82,7 @@ bool FTheiaBeacon::IsListenSocketValid() const
  *
  * @return true if both socket was created successfully, false otherwise
  */
-bool FTheiaBeacon::Init(int32 Port)
+bool FTheiaBeacon::Init(int32 Port, uint32 MulticastGroup, int32 MulticastTtl)
 {
 	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
 	bool bSuccess = false;
@@ -58,10 +105,31 @@ bool FTheiaBeacon::Init(int32 Port)
 		// Bind to our listen port
 		if (ListenSocket->Bind(*ListenAddr))
 		{
-			// Set it to broadcast mode, so we can send on it
-			// NOTE: You must set this to broadcast mode on Xbox 360 or the
-			// secure layer will eat any packets sent
-			bSuccess = ListenSocket->SetBroadcast();
+			// Only processes that joined the group get woken by our traffic
+			if (MulticastGroup != 0)
+			{
+				TSharedRef<FInternetAddr> GroupAddr = SocketSubsystem->CreateInternetAddr(MulticastGroup, Port);
+				if (ListenSocket->JoinMulticastGroup(*GroupAddr))
+				{
+					ListenSocket->SetMulticastTtl((uint8)FMath::Clamp(MulticastTtl, 1, 255));
+					// Other game instances on this machine are just as interested
+					ListenSocket->SetMulticastLoopback(true);
+					BroadcastAddr->SetIp(MulticastGroup);
+					bSuccess = true;
+					UE_LOG(LogOnline, Verbose, TEXT("LAN beacon joined multicast group %s"), *GroupAddr->ToString(true));
+				}
+				else
+				{
+					UE_LOG(LogOnline, Warning, TEXT("Failed to join multicast group %s, broadcasting instead"), *GroupAddr->ToString(true));
+				}
+			}
+			if (!bSuccess)
+			{
+				// Set it to broadcast mode, so we can send on it
+				// NOTE: You must set this to broadcast mode on Xbox 360 or the
+				// secure layer will eat any packets sent
+				bSuccess = ListenSocket->SetBroadcast();
+			}
 		}
 		else
 		{
@@ -73,6 +141,10 @@ bool FTheiaBeacon::Init(int32 Port)
 	{
 		UE_LOG(LogOnline, Error, TEXT("Failed to create listen socket for LAN beacon"));
 	}
+	if (bSuccess && ListenSocket)
+	{
+		RequestedPort = Port;
+	}
 	return bSuccess && ListenSocket;
 }
 
@@ -147,24 +219,58 @@ bool FTheiaBeacon::InitHost(int32 Port)
 		UE_LOG(LogOnline, Error, TEXT("Failed to create listen socket for LAN beacon"));
 	}
 
+	if (bSuccess && ListenSocket)
+	{
+		RequestedPort = Port;
+	}
 	return bSuccess && ListenSocket;
 }
 
 
-bool FTheiaBeacon::InitClient(int32 IP, int32 Port, int32 ListenPort)
+bool FTheiaBeacon::InitHostShard(int32 Port)
 {
-	UE_LOG(LogOnline, VeryVerbose, TEXT("LanBeacon InitClient IP from blueprint is %u"), IP);
-
 	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
 	bool bSuccess = false;
 
-	// Set IP of Host to Connect To
-	BroadcastAddr = SocketSubsystem->CreateInternetAddr(IP, (int)Port);
-	BroadcastAddr->SetIp(IP);
+	ListenAddr = SocketSubsystem->GetLocalBindAddr(*GLog);
+	ListenAddr->SetPort(Port);
+	// A temporary "received from" address
+	SockAddr = SocketSubsystem->CreateInternetAddr();
 
-	BroadcastAddr->SetPort((int)Port);
+	ListenSocket = SocketSubsystem->CreateSocket(NAME_DGram, TEXT("Theia beacon shard"), true);
+	if (ListenSocket != NULL)
+	{
+		ListenSocket->SetNonBlocking();
+		ListenSocket->SetRecvErr();
+		// Also sets SO_REUSEPORT where the platform has it, which is what lets the shards share the port.
+		// A shard never moves to another port, queries for it would never arrive
+		if (ListenSocket->SetReuseAddr() && ListenSocket->Bind(*ListenAddr))
+		{
+			bSuccess = true;
+			RequestedPort = Port;
+		}
+		else
+		{
+			UE_LOG(LogOnline, Warning, TEXT("Failed to bind beacon shard socket to addr (%s)"), *ListenAddr->ToString(true));
+		}
+	}
+	else
+	{
+		UE_LOG(LogOnline, Error, TEXT("Failed to create beacon shard socket"));
+	}
+	return bSuccess;
+}
 
-	UE_LOG(LogOnline, VeryVerbose, TEXT("LanBeacon InitClient Broadcast Address is %s "), *BroadcastAddr->ToString(true));
+
+bool FTheiaBeacon::InitClient(const TArray<FTheiaHostEndpoint>& Hosts, int32 ListenPort, int32 PortRange)
+{
+	UE_LOG(LogOnline, VeryVerbose, TEXT("LanBeacon InitClient querying %d hosts"), Hosts.Num());
+
+	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
+	bool bSuccess = false;
+
+	// Set the hosts to connect to, their beacons listen just above the game port
+	SetHostAddrs(Hosts, PortRange);
 
 	// Now the listen address peep change object *GWarn to Glog
 	ListenAddr = SocketSubsystem->GetLocalBindAddr(*GLog);
@@ -237,9 +343,40 @@ bool FTheiaBeacon::InitClient(int32 IP, int32 Port, int32 ListenPort)
 	else
 	{
 
+	}
+	if (bSuccess && ListenSocket)
+	{
+		RequestedPort = ListenPort;
 	}
 	return bSuccess && ListenSocket;
 }
+
+void FTheiaBeacon::SetHostAddrs(const TArray<FTheiaHostEndpoint>& Hosts, int32 PortRange)
+{
+	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
+	PortRange = FMath::Max(PortRange, 1);
+	// Build every destination up front, a query then goes out as one tight run of sends
+	HostAddrs.Reset(Hosts.Num() * PortRange);
+	for (const FTheiaHostEndpoint& Host : Hosts)
+	{
+		TSharedRef<FInternetAddr> HostAddr = SocketSubsystem->CreateInternetAddr();
+		bool bIsValid = false;
+		HostAddr->SetIp(*Host.Address, bIsValid);
+		if (!bIsValid)
+		{
+			UE_LOG(LogOnline, Warning, TEXT("LanBeacon cannot reach host %s with this socket subsystem"), *Host.Address);
+			continue;
+		}
+
+		const int32 BeaconPort = Host.Port + THEIA_BEACON_PORT_OFFSET;
+		for (int32 PortIndex = 0; PortIndex < PortRange; PortIndex++)
+		{
+			HostAddr->SetPort(BeaconPort + PortIndex);
+			HostAddrs.Add(CloneAddr(*HostAddr));
+		}
+		UE_LOG(LogOnline, VeryVerbose, TEXT("LanBeacon querying host %s on %d ports"), *HostAddrs.Last()->ToString(false), PortRange);
+	}
+}
 /**
  * Called to poll the socket for pending data. Any data received is placed
  * in the specified packet buffer
@@ -267,6 +404,18 @@ int32 FTheiaBeacon::ReceivePacket(uint8* PacketData, int32 BufferSize)
 	return BytesRead;
 }
 
+/**
+ * Blocks until the socket has data to read or the wait time elapses
+ *
+ * @param WaitTime the maximum amount of time to block
+ *
+ * @return true if there is data waiting to be read, false otherwise
+ */
+bool FTheiaBeacon::WaitForData(const FTimespan& WaitTime)
+{
+	return ListenSocket != NULL && ListenSocket->Wait(ESocketWaitConditions::WaitForRead, WaitTime);
+}
+
 /**
  * Uses the cached broadcast address to send packet to a subnet
  *
@@ -275,8 +424,23 @@ int32 FTheiaBeacon::ReceivePacket(uint8* PacketData, int32 BufferSize)
  */
 bool FTheiaBeacon::BroadcastPacket(uint8* Packet, int32 Length)
 {
+	if (HostAddrs.Num() > 0)
+	{
+		// Query every known host port in one burst, answers from any of them are merged as they come in
+		int32 NumSent = 0;
+		for (const TSharedRef<FInternetAddr>& HostAddr : HostAddrs)
+		{
+			int32 BytesSent = 0;
+			if (ListenSocket->SendTo(Packet, Length, BytesSent, *HostAddr) && (BytesSent == Length))
+			{
+				NumSent++;
+			}
+		}
+		UE_LOG(LogOnline, Verbose, TEXT("BroadcastPacket: Sent %d bytes to %d of %d host ports"), Length, NumSent, HostAddrs.Num());
+		return NumSent > 0;
+	}
+
 	int32 BytesSent = 0;
-	BroadcastAddr->SetPort(BroadcastAddr->GetPort() + 1);
 	UE_LOG(LogOnline, Verbose, TEXT("BroadcastPacket: Sending %d bytes to %s"), Length, *BroadcastAddr->ToString(true));
 	return ListenSocket->SendTo(Packet, Length, BytesSent, *BroadcastAddr) && (BytesSent == Length);
 }
@@ -294,26 +458,186 @@ bool FTheiaBeacon::BroadcastPacketFromSocket(uint8* Packet, int32 Length)
 
 }
 
+bool FTheiaBeacon::EnableReadinessPolling()
+{
+	if (!bUsesReadinessPolling && ListenSocket != NULL)
+	{
+		bUsesReadinessPolling = FTheiaBeaconPoller::Get().Register(*this);
+	}
+	return bUsesReadinessPolling;
+}
+
+void FTheiaBeacon::DisableReadinessPolling()
+{
+	if (bUsesReadinessPolling)
+	{
+		// Don't bring the poller back to life if it was torn down before this beacon went away
+		FTheiaBeaconPoller* Poller = FTheiaBeaconPoller::GetIfExists();
+		if (Poller != NULL)
+		{
+			Poller->Unregister(*this);
+		}
+		bUsesReadinessPolling = false;
+		bIsReadable = false;
+	}
+}
+
+bool FTheiaBeacon::ConsumeReadiness()
+{
+	if (bIsReadable)
+	{
+		// Clear before draining, anything arriving afterwards gets flagged again
+		bIsReadable = false;
+		FTheiaBeaconPoller* Poller = FTheiaBeaconPoller::GetIfExists();
+		if (Poller != NULL)
+		{
+			Poller->Wake();
+		}
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Drains pending datagrams from the socket into the preallocated receive ring
+ *
+ * @return the number of datagrams received, GetBatchSize() if more may be pending
+ */
+int32 FTheiaBeacon::ReceivePacketBatch()
+{
+	int32 NumReceived = 0;
+	if (ListenSocket != NULL)
+	{
+		// One recvmmsg fills the ring where the platform has it
+		NumReceived = FTheiaNativeSocket::ReceiveBatch(ListenSocket, ReceiveRing.GetData(), ReceiveRing.Num());
+		if (NumReceived < 0)
+		{
+			// FSocket has no multi-datagram receive, so fill the ring until the socket runs dry
+			NumReceived = 0;
+			int32 NumFailed = 0;
+			ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM);
+			while (NumReceived < ReceiveRing.Num() && NumFailed < ReceiveRing.Num())
+			{
+				FTheiaBeaconPacket& Slot = ReceiveRing[NumReceived];
+				Slot.Length = 0;
+				if (ListenSocket->RecvFrom(Slot.Data, THEIA_BEACON_MAX_DATAGRAM_SIZE, Slot.Length, *Slot.Addr))
+				{
+					if (Slot.Length > 0)
+					{
+						NumReceived++;
+					}
+					else
+					{
+						NumFailed++;
+					}
+				}
+				// Only would-block means the socket is dry, any other error is just this datagram
+				else if (SocketSubsystem->GetLastErrorCode() == SE_EWOULDBLOCK)
+				{
+					break;
+				}
+				else
+				{
+					NumFailed++;
+				}
+			}
+		}
+		if (NumReceived > 0)
+		{
+			UE_LOG(LogOnline, Verbose, TEXT("Received a batch of %d packets"), NumReceived);
+		}
+	}
+	return NumReceived;
+}
+
+void FTheiaBeacon::SetReplyAddr(const FInternetAddr& Addr)
+{
+	CopyAddr(*SockAddr, Addr);
+}
+
+bool FTheiaBeacon::QueuePacket(const uint8* Packet, int32 Length, const FInternetAddr& Destination)
+{
+	if (Length > THEIA_BEACON_MAX_DATAGRAM_SIZE)
+	{
+		UE_LOG(LogOnline, Warning, TEXT("Cannot queue %d byte packet, larger than %d"), Length, THEIA_BEACON_MAX_DATAGRAM_SIZE);
+		return false;
+	}
+
+	if (NumPendingSends == SendRing.Num())
+	{
+		FlushPendingPackets();
+	}
+
+	FTheiaBeaconPacket& Slot = SendRing[NumPendingSends++];
+	FMemory::Memcpy(Slot.Data, Packet, Length);
+	Slot.Length = Length;
+	CopyAddr(*Slot.Addr, Destination);
+	return true;
+}
+
+bool FTheiaBeacon::QueueBroadcastPacket(const uint8* Packet, int32 Length)
+{
+	return BroadcastAddr.IsValid() && QueuePacket(Packet, Length, *BroadcastAddr);
+}
+
+bool FTheiaBeacon::QueuePacketToSender(const uint8* Packet, int32 Length)
+{
+	return QueuePacket(Packet, Length, *SockAddr);
+}
+
+/**
+ * Sends every queued packet
+ *
+ * @return the number of packets sent successfully
+ */
+int32 FTheiaBeacon::FlushPendingPackets()
+{
+	int32 NumSent = 0;
+	if (ListenSocket != NULL)
+	{
+		// One sendmmsg for the whole ring where the platform has it
+		NumSent = NumPendingSends > 0 ? FTheiaNativeSocket::SendBatch(ListenSocket, SendRing.GetData(), NumPendingSends) : 0;
+		if (NumSent < 0)
+		{
+			NumSent = 0;
+			for (int32 Index = 0; Index < NumPendingSends; Index++)
+			{
+				const FTheiaBeaconPacket& Slot = SendRing[Index];
+				int32 BytesSent = 0;
+				if (ListenSocket->SendTo(Slot.Data, Slot.Length, BytesSent, *Slot.Addr) && BytesSent == Slot.Length)
+				{
+					NumSent++;
+				}
+			}
+		}
+		if (NumPendingSends > 0)
+		{
+			UE_LOG(LogOnline, Verbose, TEXT("Flushed %d of %d queued packets"), NumSent, NumPendingSends);
+		}
+	}
+	NumPendingSends = 0;
+	return NumSent;
+}
+
 bool FTheiaSession::Host(FOnValidQueryPacketDelegate& QueryDelegate, int32 Port)
 {
 	UE_LOG(LogOnline, VeryVerbose, TEXT("LanBeacon Host Incoming Port is %u "), Port);
 	bool bSuccess = false;
-	if (TheiaBeacon != NULL)
-	{
-		StopTheiaSession();
-	}
+	StopHosting();
 
-	// Bind a socket for LAN beacon activity
-	TheiaBeacon = new FTheiaBeacon();
 	//if its LAN Connection
 	if (Port == -1)
 	{
-		if (TheiaBeacon->Init(TheiaAnnouncePort))
+		// Bind a socket for LAN beacon activity
+		HostBeacon = PrepareBeacon(ETheiaBeaconSocketType::Lan, TheiaAnnouncePort);
+		if (HostBeacon != NULL)
 		{
 
 			AddOnValidQueryPacketDelegate_Handle(QueryDelegate);
 			// We successfully created everything so mark the socket as needing polling
-			TheiaBeaconState = ELanBeaconState::Hosting;
+			bIsHosting = true;
+			bIsHostingLAN = true;
+			RestartPolling(HostBeacon);
 			bSuccess = true;
 			UE_LOG(LogOnline, Verbose, TEXT("Listening for LAN beacon requests on %d"), TheiaAnnouncePort);
 		}
@@ -324,12 +648,15 @@ bool FTheiaSession::Host(FOnValidQueryPacketDelegate& QueryDelegate, int32 Port)
 	}
 	else
 	{
-		if (TheiaBeacon->InitHost(Port))
+		HostBeacon = PrepareBeacon(ETheiaBeaconSocketType::OnlineHost, Port);
+		if (HostBeacon != NULL)
 		{
 
 			AddOnValidQueryPacketDelegate_Handle(QueryDelegate);
 			// We successfully created everything so mark the socket as needing polling
-			TheiaBeaconState = ELanBeaconState::Hosting;
+			bIsHosting = true;
+			bIsHostingLAN = false;
+			RestartPolling(HostBeacon);
 			bSuccess = true;
 			UE_LOG(LogOnline, Verbose, TEXT("Listening for Online beacon requests on %u"), Port);
 		}
@@ -348,18 +675,17 @@ bool FTheiaSession::Host(FOnValidQueryPacketDelegate& QueryDelegate)
 {
 	UE_LOG(LogOnline, VeryVerbose, TEXT("Host: Creating Host Lan Beacon"));
 	bool bSuccess = false;
-	if (TheiaBeacon != NULL)
-	{
-		StopTheiaSession();
-	}
+	StopHosting();
 
 	// Bind a socket for LAN beacon activity
-	TheiaBeacon = new FTheiaBeacon();
-	if (TheiaBeacon->Init(TheiaAnnouncePort))
+	HostBeacon = PrepareBeacon(ETheiaBeaconSocketType::Lan, TheiaAnnouncePort);
+	if (HostBeacon != NULL)
 	{
 		AddOnValidQueryPacketDelegate_Handle(QueryDelegate);
 		// We successfully created everything so mark the socket as needing polling
-		TheiaBeaconState = ELanBeaconState::Hosting;
+		bIsHosting = true;
+		bIsHostingLAN = true;
+		RestartPolling(HostBeacon);
 		bSuccess = true;
 		UE_LOG(LogOnline, Verbose, TEXT("Listening for LAN beacon requests on %d"),	TheiaAnnouncePort);
 	}
@@ -382,16 +708,13 @@ bool FTheiaSession::Search(FNboSerializeToBuffer& Packet, FOnValidResponsePacket
 
 	UE_LOG(LogOnline, VeryVerbose, TEXT("Search: searching for lan session"));
 	bool bSuccess = true;
-	if (TheiaBeacon != NULL)
-	{
-		StopTheiaSession();
-	}
+	StopSearching();
 
-	// Bind a socket for LAN beacon activity
-	TheiaBeacon = new FTheiaBeacon();
+	// Bind a socket for LAN beacon activity, shared with hosting on the announce port
 	if (IsLANMatch)
 	{
-		if (TheiaBeacon->Init(TheiaAnnouncePort) == false)
+		SearchBeacon = PrepareBeacon(ETheiaBeaconSocketType::Lan, TheiaAnnouncePort);
+		if (SearchBeacon == NULL)
 		{
 			UE_LOG(LogOnline, Warning, TEXT("Failed to create socket for lan announce port %s"), ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->GetSocketError());
 			bSuccess = false;
@@ -401,7 +724,8 @@ bool FTheiaSession::Search(FNboSerializeToBuffer& Packet, FOnValidResponsePacket
 	{
 		UE_LOG(LogOnline, VeryVerbose, TEXT("LanBeacon Search Init OnlineBeacon"));
 		// Bind a socket for Online beacon activity
-		if (TheiaBeacon->InitClient(HostSessionAddr, HostSessionPort, ClientSessionPort) == false)
+		SearchBeacon = PrepareBeacon(ETheiaBeaconSocketType::OnlineClient, ClientSessionPort, SearchHosts);
+		if (SearchBeacon == NULL)
 		{
 			UE_LOG(LogOnline, VeryVerbose, TEXT("Failed to create socket for lan announce port %s"), ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->GetSocketError());
 			bSuccess = false;
@@ -409,19 +733,36 @@ bool FTheiaSession::Search(FNboSerializeToBuffer& Packet, FOnValidResponsePacket
 	}
 
 	// If we have a socket and a nonce, broadcast a discovery packet
-	if (TheiaBeacon && bSuccess)
+	if (SearchBeacon && bSuccess)
 	{
 		// Now kick off our broadcast which hosts will respond to
-		if (TheiaBeacon->BroadcastPacket(Packet, Packet.GetByteCount()))
+		if (SearchBeacon->BroadcastPacket(Packet, Packet.GetByteCount()))
 		{
 			UE_LOG(LogOnline, Verbose, TEXT("Sent query packet..."));
 			// We need to poll for the return packets
-			TheiaBeaconState = ELanBeaconState::Searching;
+			bIsSearching = true;
+			ActiveSearchNonce.Set((int64)TheiaNonce);
 			// Set the timestamp for timing out a search
 			TheiaQueryTimeLeft = TheiaQueryTimeout;
+			TheiaSearchTime = 0.f;
+			TheiaSearchQuietTime = 0.f;
+			TheiaQuerySentTime = FPlatformTime::Seconds();
+
+			// Whatever was left of the last search's fragments is of no use any more
+			FragmentReassembler.Reset();
+
+			// Keep the query around in case it has to be sent again
+			TheiaQueryPacket.Reset();
+			TheiaQueryPacket.Append((uint8*)Packet, Packet.GetByteCount());
+			TheiaQueryRetransmitsLeft = SearchRetransmitCount;
+			TheiaRetransmitDelay = SearchRetransmitDelay;
+			TheiaNextRetransmitTime = TheiaRetransmitDelay;
 
 			AddOnValidResponsePacketDelegate_Handle(ResponseDelegate);
 			AddOnSearchingTimeoutDelegate_Handle(TimeoutDelegate);
+
+			// The query is out, responses can be collected off the game thread from here on
+			RestartPolling(SearchBeacon);
 		}
 		else
 		{
@@ -430,6 +771,10 @@ bool FTheiaSession::Search(FNboSerializeToBuffer& Packet, FOnValidResponsePacket
 		}
 	}
 
+	if (!bSuccess)
+	{
+		SearchBeacon = NULL;
+	}
 	return bSuccess;
 }
 
@@ -437,78 +782,447 @@ bool FTheiaSession::Search(FNboSerializeToBuffer& Packet, FOnValidResponsePacket
 void FTheiaSession::StopTheiaSession()
 {
 	UE_LOG(LogOnline, VeryVerbose, TEXT("StopLANSession: stopping lan session"));
-	// Don't poll anymore since we are shutting it down
-	TheiaBeaconState = ELanBeaconState::NotUsingLanBeacon;
+	StopSearching();
+	StopHosting();
+}
 
-	// Unbind the LAN beacon object
-	if (TheiaBeacon)
-	{	
-		delete TheiaBeacon;
-		TheiaBeacon = NULL;
+void FTheiaSession::StopHosting()
+{
+	if (bIsHosting && NumRateLimitedQueries.GetValue() > 0)
+	{
+		UE_LOG(LogOnline, Verbose, TEXT("Dropped %d queries over their source's rate limit so far"), NumRateLimitedQueries.GetValue());
+	}
+	// Keep the socket open, the next Host only switches it back on
+	FTheiaBeacon* Beacon = HostBeacon;
+	bIsHosting = false;
+	HostBeacon = NULL;
+	if (Beacon != NULL)
+	{
+		RestartPolling(Beacon);
 	}
-
-	// Clear delegates
 	OnValidQueryPacketDelegates.Clear();
+}
+
+void FTheiaSession::StopSearching()
+{
+	// Keep the socket open, the next Search only switches it back on
+	FTheiaBeacon* Beacon = SearchBeacon;
+	bIsSearching = false;
+	ActiveSearchNonce.Reset();
+	SearchBeacon = NULL;
+	if (Beacon != NULL)
+	{
+		RestartPolling(Beacon);
+	}
 	OnValidResponsePacketDelegates.Clear();
 	OnSearchingTimeoutDelegates.Clear();
 }
 
+FTheiaBeacon* FTheiaSession::PrepareBeacon(ETheiaBeaconSocketType::Type SocketType, int32 ListenPort, const TArray<FTheiaHostEndpoint>& Hosts)
+{
+	FTheiaBeacon*& Beacon = Beacons[SocketType];
+	if (Beacon != NULL && Beacon->IsBoundFor(ListenPort))
+	{
+		UE_LOG(LogOnline, VeryVerbose, TEXT("Reusing beacon socket bound for port %d"), ListenPort);
+		if (SocketType == ETheiaBeaconSocketType::OnlineClient)
+		{
+			Beacon->SetHostAddrs(Hosts, SearchPortRange);
+		}
+		return Beacon;
+	}
+
+	if (Beacon != NULL && (Beacon == HostBeacon || Beacon == SearchBeacon))
+	{
+		UE_LOG(LogOnline, Warning, TEXT("Beacon socket for port %d is in use by another role"), ListenPort);
+		return NULL;
+	}
+
+	// Nothing open for this port yet, replace whatever was bound for another one
+	StopBeaconThread(SocketType);
+	if (SocketType == ETheiaBeaconSocketType::OnlineHost)
+	{
+		CloseHostShards();
+	}
+	delete Beacon;
+	Beacon = NewBeacon();
+
+	bool bSuccess = false;
+	switch (SocketType)
+	{
+	case ETheiaBeaconSocketType::Lan:
+		bSuccess = Beacon->Init(ListenPort, GetMulticastGroupIp(), MulticastTtl);
+		break;
+	case ETheiaBeaconSocketType::OnlineHost:
+		bSuccess = Beacon->InitHost(ListenPort);
+		if (bSuccess && HostListenShards > 1)
+		{
+			OpenHostShards(*Beacon);
+		}
+		break;
+	case ETheiaBeaconSocketType::OnlineClient:
+		bSuccess = Beacon->InitClient(Hosts, ListenPort, SearchPortRange);
+		break;
+	}
+
+	if (!bSuccess)
+	{
+		delete Beacon;
+		Beacon = NULL;
+	}
+	return Beacon;
+}
+
+FTheiaBeacon* FTheiaSession::NewBeacon() const
+{
+	return new FTheiaBeacon(BeaconBatchSize);
+}
+
+bool FTheiaSession::AllowQuery(const FInternetAddr& Source)
+{
+	if (!QueryRateLimiter.IsEnabled() || QueryRateLimiter.Allow(Source, FPlatformTime::Seconds()))
+	{
+		return true;
+	}
+	NumRateLimitedQueries.Increment();
+	return false;
+}
+
+void FTheiaSession::DestroyBeacons()
+{
+	HostBeacon = NULL;
+	SearchBeacon = NULL;
+	CloseHostShards();
+	for (int32 SocketType = 0; SocketType < ETheiaBeaconSocketType::Count; SocketType++)
+	{
+		StopBeaconThread(SocketType);
+		delete Beacons[SocketType];
+		Beacons[SocketType] = NULL;
+	}
+}
+
+void FTheiaSession::OpenHostShards(const FTheiaBeacon& InHostBeacon)
+{
+	CloseHostShards();
+	// Shards have to land on the port the host beacon ended up with, not the one it asked for
+	const int32 BoundPort = InHostBeacon.GetBoundPort();
+	for (int32 ShardIndex = 1; ShardIndex < HostListenShards; ShardIndex++)
+	{
+		FTheiaBeacon* Shard = NewBeacon();
+		if (!Shard->InitHostShard(BoundPort))
+		{
+			UE_LOG(LogOnline, Warning, TEXT("Only opened %d of %d host listen shards on port %d"), ShardIndex, HostListenShards, BoundPort);
+			delete Shard;
+			break;
+		}
+		HostShardBeacons.Add(Shard);
+	}
+}
+
+void FTheiaSession::CloseHostShards()
+{
+	StopHostShardThreads();
+	for (FTheiaBeacon* Shard : HostShardBeacons)
+	{
+		delete Shard;
+	}
+	HostShardBeacons.Reset();
+}
+
+void FTheiaSession::StartHostShardThreads()
+{
+	StopHostShardThreads();
+	static int32 ShardThreadIndex = 0;
+	for (int32 ShardIndex = 0; ShardIndex < HostShardBeacons.Num(); ShardIndex++)
+	{
+		// Shards only answer queries, so nothing is ever queued for the game thread
+		FTheiaBeaconThread* Runnable = new FTheiaBeaconThread(*this, *HostShardBeacons[ShardIndex], true, false, 0);
+		FRunnableThread* Thread = FRunnableThread::Create(Runnable, *FString::Printf(TEXT("TheiaBeaconShard(%d)"), ShardThreadIndex++), 128 * 1024, TPri_Normal);
+		if (Thread != NULL)
+		{
+			HostShardRunnables.Add(Runnable);
+			HostShardThreads.Add(Thread);
+		}
+		else
+		{
+			// Nobody would read the queries the OS hands this socket, close it so they go to the others
+			UE_LOG(LogOnline, Warning, TEXT("Failed to create Theia beacon shard thread, closing the shard"));
+			delete Runnable;
+			delete HostShardBeacons[ShardIndex];
+			HostShardBeacons.RemoveAt(ShardIndex--);
+		}
+	}
+}
+
+void FTheiaSession::StopHostShardThreads()
+{
+	for (FRunnableThread* Thread : HostShardThreads)
+	{
+		// Stops the runnable and waits for it to exit
+		delete Thread;
+	}
+	HostShardThreads.Reset();
+
+	for (FTheiaBeaconThread* Runnable : HostShardRunnables)
+	{
+		delete Runnable;
+	}
+	HostShardRunnables.Reset();
+}
+
+uint32 FTheiaSession::GetMulticastGroupIp() const
+{
+	FIPv4Address GroupAddress;
+	if (bUseMulticast)
+	{
+		if (FIPv4Address::Parse(MulticastGroup, GroupAddress) && GroupAddress.IsMulticastAddress())
+		{
+			return GroupAddress.Value;
+		}
+		UE_LOG(LogOnline, Warning, TEXT("MulticastGroup %s is not a multicast address, broadcasting instead"), *MulticastGroup);
+	}
+	return 0;
+}
+
+int32 FTheiaSession::GetBeaconSocketType(const FTheiaBeacon* Beacon) const
+{
+	if (Beacon != NULL)
+	{
+		for (int32 SocketType = 0; SocketType < ETheiaBeaconSocketType::Count; SocketType++)
+		{
+			if (Beacons[SocketType] == Beacon)
+			{
+				return SocketType;
+			}
+		}
+	}
+	return INDEX_NONE;
+}
+
 void FTheiaSession::Tick(float DeltaTime)
 {
-	if (TheiaBeaconState == ELanBeaconState::NotUsingLanBeacon)
+	if (!bIsHosting && !bIsSearching)
 	{
 		return;
 	}
 
-	uint8 PacketData[LAN_BEACON_MAX_PACKET_SIZE];
+	for (int32 SocketType = 0; SocketType < ETheiaBeaconSocketType::Count; SocketType++)
+	{
+		FTheiaBeacon* Beacon = Beacons[SocketType];
+		if (Beacon == NULL || (!IsAnsweringQueries(Beacon) && !IsCollectingResponses(Beacon)))
+		{
+			continue;
+		}
+
+		if (BeaconThreadRunnables[SocketType])
+		{
+			// The beacon thread has already validated these, just hand them out
+			FTheiaBeaconEvent Event;
+			while (IsCollectingResponses(Beacon) && BeaconThreadRunnables[SocketType]->DequeueEvent(Event))
+			{
+				TriggerOnValidResponsePacketDelegates(Event.Payload.GetData(), Event.Payload.Num(), *Event.FromAddr);
+				TheiaSearchQuietTime = 0.f;
+			}
+		}
+		else if (!Beacon->UsesReadinessPolling() || Beacon->ConsumeReadiness())
+		{
+			ReceivePackets(*Beacon);
+		}
+	}
+
+	TickSearchTimeout(DeltaTime);
+}
+
+void FTheiaSession::ReceivePackets(FTheiaBeacon& Beacon)
+{
 	bool bShouldRead = true;
-	// Read each pending packet and pass it out for processing
+	// Read each pending batch of packets and pass them out for processing
 	while (bShouldRead)
 	{
-		int32 NumRead = TheiaBeacon->ReceivePacket(PacketData, LAN_BEACON_MAX_PACKET_SIZE);
-		if (NumRead > 0)
+		const int32 NumPackets = Beacon.ReceivePacketBatch();
+		// Check every header of the batch before handling any of it
+		ReceivedPacketKinds.SetNumUninitialized(NumPackets, false);
+		HeaderCodec.ClassifyBatch(Beacon, NumPackets, TheiaNonce, ReceivedPacketKinds.GetData());
+		for (int32 PacketIndex = 0; PacketIndex < NumPackets; PacketIndex++)
 		{
-			// Check our mode to determine the type of allowed packets
-			if (TheiaBeaconState == ELanBeaconState::Hosting)
+			FTheiaBeaconPacket& Received = Beacon.GetReceivedPacket(PacketIndex);
+			uint8* PacketData = Received.Data;
+			const int32 NumRead = Received.Length;
+
+			// Route by packet type, the socket may be hosting and searching at once
+			const ETheiaBeaconPacketKind::Type PacketKind = ReceivedPacketKinds[PacketIndex];
+			if (PacketKind == ETheiaBeaconPacketKind::Query && IsAnsweringQueries(&Beacon))
 			{
-				uint64 ClientNonce;
-				// We can only accept Server Query packets
-				if (IsValidTheiaQueryPacket(PacketData, NumRead, ClientNonce))
+				const uint64 ClientNonce = FTheiaBeaconHeaderCodec::ReadNonce(PacketData);
+				if (!IsOwnQuery(ClientNonce) && AllowQuery(*Received.Addr))
 				{
+					// Any replies go back to whoever sent this query
+					Beacon.SetReplyAddr(*Received.Addr);
 					// Strip off the header
 					TriggerOnValidQueryPacketDelegates(&PacketData[LAN_BEACON_PACKET_HEADER_SIZE], NumRead - LAN_BEACON_PACKET_HEADER_SIZE, ClientNonce);
 				}
 			}
-			else if (TheiaBeaconState == ELanBeaconState::Searching)
+			else if (PacketKind == ETheiaBeaconPacketKind::Response && IsCollectingResponses(&Beacon))
+			{
+				// Strip off the header
+				TriggerOnValidResponsePacketDelegates(&PacketData[LAN_BEACON_PACKET_HEADER_SIZE], NumRead - LAN_BEACON_PACKET_HEADER_SIZE, *Received.Addr);
+				TheiaSearchQuietTime = 0.f;
+			}
+			else if (PacketKind == ETheiaBeaconPacketKind::Fragment && IsCollectingResponses(&Beacon))
 			{
-				// We can only accept Server Response packets
-				if (IsValidTheiaResponsePacket(PacketData, NumRead))
+				// Handed out like any other response once the whole session is in
+				TheiaSearchQuietTime = 0.f;
+				if (FragmentReassembler.AddFragment(&PacketData[LAN_BEACON_PACKET_HEADER_SIZE], NumRead - LAN_BEACON_PACKET_HEADER_SIZE, TheiaNonce, FPlatformTime::Seconds(), ReassembledResponse))
 				{
-					// Strip off the header
-					TriggerOnValidResponsePacketDelegates(&PacketData[LAN_BEACON_PACKET_HEADER_SIZE], NumRead - LAN_BEACON_PACKET_HEADER_SIZE);
+					TriggerOnValidResponsePacketDelegates(ReassembledResponse.GetData(), ReassembledResponse.Num(), *Received.Addr);
 				}
 			}
 		}
-		else
+
+		// Send every response queued while handling this batch at once
+		Beacon.FlushPendingPackets();
+
+		// A partial batch means the socket has been drained
+		bShouldRead = (NumPackets == Beacon.GetBatchSize());
+	}
+}
+
+void FTheiaSession::TickSearchTimeout(float DeltaTime)
+{
+	if (bIsSearching)
+	{
+		// Decrement the amount of time remaining
+		TheiaQueryTimeLeft -= DeltaTime;
+		TheiaSearchTime += DeltaTime;
+		TheiaSearchQuietTime += DeltaTime;
+		// A single dropped query would otherwise leave the search empty
+		if (TheiaQueryRetransmitsLeft > 0 && TheiaSearchTime >= TheiaNextRetransmitTime && TheiaQueryTimeLeft > 0.f)
 		{
-			if (TheiaBeaconState == ELanBeaconState::Searching)
+			TheiaQueryRetransmitsLeft--;
+			// TheiaQuerySentTime stays at the first send, a late answer to it must not look like a fast one
+			if (SearchBeacon->BroadcastPacket(TheiaQueryPacket.GetData(), TheiaQueryPacket.Num()))
 			{
-				// Decrement the amount of time remaining
-				TheiaQueryTimeLeft -= DeltaTime;
-				// Check for a timeout on the search packet
-				if (TheiaQueryTimeLeft <= 0.f)
-				{
-					TriggerOnSearchingTimeoutDelegates();
-				}
+				UE_LOG(LogOnline, Verbose, TEXT("Resent query packet, %d retransmits left"), TheiaQueryRetransmitsLeft);
+				// Give hosts the same quiet period to answer the resent query
+				TheiaSearchQuietTime = 0.f;
 			}
-			bShouldRead = false;
+			TheiaRetransmitDelay *= 2.f;
+			TheiaNextRetransmitTime = TheiaSearchTime + TheiaRetransmitDelay;
+		}
+		// Hosts that answer do so quickly, so a long enough silence after the last send means everyone has been heard
+		const bool bIsQuiet = SearchQuietPeriod > 0.f &&
+			TheiaSearchTime >= SearchMinTime &&
+			TheiaQueryRetransmitsLeft == 0 &&
+			TheiaSearchQuietTime >= SearchQuietPeriod;
+		// Check for a timeout on the search packet
+		if (TheiaQueryTimeLeft <= 0.f || bIsQuiet)
+		{
+			TriggerOnSearchingTimeoutDelegates();
+		}
+	}
+}
+
+void FTheiaSession::RestartPolling(FTheiaBeacon* Beacon)
+{
+	const int32 SocketType = GetBeaconSocketType(Beacon);
+	if (SocketType == INDEX_NONE)
+	{
+		return;
+	}
+
+	// The thread was started for the previous roles, it has to let go of the socket first
+	StopBeaconThread(SocketType);
+	const bool bHasShards = SocketType == ETheiaBeaconSocketType::OnlineHost && HostShardBeacons.Num() > 0;
+	if (bHasShards)
+	{
+		StopHostShardThreads();
+	}
+
+	const bool bAnswerQueries = IsAnsweringQueries(Beacon);
+	const bool bCollectResponses = IsCollectingResponses(Beacon);
+	if (!bAnswerQueries && !bCollectResponses)
+	{
+		// Don't drop responses that were queued before the role stopped
+		Beacon->FlushPendingPackets();
+		return;
+	}
+
+	if (bHasShards && bAnswerQueries)
+	{
+		StartHostShardThreads();
+	}
+
+	// The shards are answered off the game thread, so the socket they share the port with is too
+	if (bUseBeaconThread || bHasShards)
+	{
+		// The thread reads the socket itself, the poller would keep flagging it with nobody to clear it
+		Beacon->DisableReadinessPolling();
+		static int32 BeaconThreadIndex = 0;
+		FTheiaBeaconThread* Runnable = new FTheiaBeaconThread(*this, *Beacon, bAnswerQueries, bCollectResponses, BeaconThreadQueueSize);
+		FRunnableThread* Thread = FRunnableThread::Create(Runnable, *FString::Printf(TEXT("TheiaBeaconThread(%d)"), BeaconThreadIndex++), 128 * 1024, TPri_Normal);
+		if (Thread != NULL)
+		{
+			BeaconThreadRunnables[SocketType] = Runnable;
+			BeaconThreads[SocketType] = Thread;
+			return;
+		}
+		UE_LOG(LogOnline, Warning, TEXT("Failed to create Theia beacon thread, servicing the beacon on the game thread"));
+		delete Runnable;
+	}
+
+	// The game thread services the beacon, only read it when the poller has seen data
+	if (bUseReadinessPolling)
+	{
+		Beacon->EnableReadinessPolling();
+	}
+}
+
+void FTheiaSession::StopBeaconThread(int32 SocketType)
+{
+	if (BeaconThreads[SocketType])
+	{
+		// Stops the runnable and waits for it to exit
+		delete BeaconThreads[SocketType];
+		BeaconThreads[SocketType] = NULL;
+	}
+
+	if (BeaconThreadRunnables[SocketType])
+	{
+		FTheiaBeaconThread* Runnable = BeaconThreadRunnables[SocketType];
+		// The thread has exited, hand out what it validated so a role change mid search loses no responses
+		FTheiaBeaconEvent Event;
+		while (IsCollectingResponses(Beacons[SocketType]) && Runnable->DequeueEvent(Event))
+		{
+			TriggerOnValidResponsePacketDelegates(Event.Payload.GetData(), Event.Payload.Num(), *Event.FromAddr);
+			TheiaSearchQuietTime = 0.f;
 		}
+		if (Runnable->GetNumDroppedEvents() > 0)
+		{
+			UE_LOG(LogOnline, Verbose, TEXT("Theia beacon thread dropped %d events"), Runnable->GetNumDroppedEvents());
+		}
+		delete Runnable;
+		BeaconThreadRunnables[SocketType] = NULL;
 	}
 }
 
+void FTheiaSession::SetHostedResponsePayloads(const TArray<FTheiaHostedPayload>& Payloads)
+{
+	FHostedPayloadsPtr NewPayloads = MakeShareable(new TArray<FTheiaHostedPayload>(Payloads));
+	{
+		FScopeLock ScopeLock(&HostedPayloadsLock);
+		HostedPayloads = NewPayloads;
+	}
+	// Only after the swap, a thread that sees the new serial must also see the new payloads
+	HostedPayloadsSerial.Increment();
+}
+
+FTheiaSession::FHostedPayloadsPtr FTheiaSession::GetHostedResponsePayloads() const
+{
+	FScopeLock ScopeLock(&HostedPayloadsLock);
+	return HostedPayloads;
+}
+
 void FTheiaSession::CreateHostResponsePacket(FNboSerializeToBuffer& Packet, uint64 ClientNonce)
 {
-	UE_LOG(LogOnline, VeryVerbose, TEXT("CreateHostResponsePacket: creating response packet"));
 	// Add the supported version
 	Packet << LAN_BEACON_PACKET_VERSION
 		// Platform information
@@ -523,7 +1237,6 @@ void FTheiaSession::CreateHostResponsePacket(FNboSerializeToBuffer& Packet, uint
 
 void FTheiaSession::CreateClientQueryPacket(FNboSerializeToBuffer& Packet, uint64 ClientNonce)
 {
-	UE_LOG(LogOnline, VeryVerbose, TEXT("CreateClientQueryPacket: creating query packet"));
 	// Build the discovery packet
 	Packet << LAN_BEACON_PACKET_VERSION
 		// Platform information
@@ -536,19 +1249,130 @@ void FTheiaSession::CreateClientQueryPacket(FNboSerializeToBuffer& Packet, uint6
 		<< ClientNonce;
 }
 
+void FTheiaSession::StampHostResponseHeader(uint8* Buffer, uint64 ClientNonce) const
+{
+	// Same layout and network byte order as CreateHostResponsePacket
+	Buffer[0] = LAN_BEACON_PACKET_VERSION;
+	Buffer[1] = (uint8)FPlatformProperties::IsLittleEndian();
+	Buffer[2] = (uint8)(TheiaGameUniqueId >> 24);
+	Buffer[3] = (uint8)(TheiaGameUniqueId >> 16);
+	Buffer[4] = (uint8)(TheiaGameUniqueId >> 8);
+	Buffer[5] = (uint8)TheiaGameUniqueId;
+	Buffer[6] = LAN_SERVER_RESPONSE1;
+	Buffer[7] = LAN_SERVER_RESPONSE2;
+	for (int32 ByteIndex = 0; ByteIndex < 8; ByteIndex++)
+	{
+		Buffer[8 + ByteIndex] = (uint8)(ClientNonce >> (56 - ByteIndex * 8));
+	}
+}
+
+void FTheiaSession::QueueHostResponses(FTheiaBeacon& Beacon, const FSessionPayloadList& Payloads, uint64 ClientNonce) const
+{
+	uint8 Response[THEIA_BEACON_MAX_DATAGRAM_SIZE];
+	StampHostResponseHeader(Response, ClientNonce);
+
+	int32 PayloadIndex = 0;
+	while (PayloadIndex < Payloads.Num())
+	{
+		int32 ResponseSize = LAN_BEACON_PACKET_HEADER_SIZE + THEIA_RESPONSE_COUNT_SIZE;
+		int32 NumSessions = 0;
+		// Pack sessions until the next one would push the datagram over the limit
+		for (; PayloadIndex < Payloads.Num() && NumSessions < MAX_uint8; PayloadIndex++)
+		{
+			const TArray<uint8>& Payload = *Payloads[PayloadIndex].Payload;
+			if (Payload.Num() > GetMaxSessionPayloadSize())
+			{
+				// Too big to share a datagram with anything, or even to have one to itself
+				QueueSessionFragments(Beacon, Payloads[PayloadIndex], ClientNonce);
+				continue;
+			}
+			const int32 EntrySize = THEIA_RESPONSE_ENTRY_HEADER_SIZE + Payload.Num();
+			if (ResponseSize + EntrySize > MaxResponseDatagramSize)
+			{
+				break;
+			}
+			const int32 EntryHeader = Payload.Num() | Payloads[PayloadIndex].Flags;
+			Response[ResponseSize] = (uint8)(EntryHeader >> 8);
+			Response[ResponseSize + 1] = (uint8)EntryHeader;
+			FMemory::Memcpy(&Response[ResponseSize + THEIA_RESPONSE_ENTRY_HEADER_SIZE], Payload.GetData(), Payload.Num());
+			ResponseSize += EntrySize;
+			NumSessions++;
+		}
+
+		if (NumSessions > 0)
+		{
+			Response[LAN_BEACON_PACKET_HEADER_SIZE] = (uint8)NumSessions;
+			QueueHostResponse(Beacon, Response, ResponseSize);
+		}
+	}
+}
+
+void FTheiaSession::QueueHostResponse(FTheiaBeacon& Beacon, const uint8* Response, int32 Length) const
+{
+	if (bIsHostingLAN)
+	{
+		Beacon.QueueBroadcastPacket(Response, Length);
+	}
+	else
+	{
+		Beacon.QueuePacketToSender(Response, Length);
+	}
+}
+
+void FTheiaSession::QueueSessionFragments(FTheiaBeacon& Beacon, const FSessionPayloadRef& PayloadRef, uint64 ClientNonce) const
+{
+	const TArray<uint8>& Payload = *PayloadRef.Payload;
+	const int32 SessionLength = Payload.Num();
+	const int32 FragmentDataSize = GetMaxFragmentDataSize();
+	const int32 NumFragments = (SessionLength + FragmentDataSize - 1) / FragmentDataSize;
+	if (SessionLength > THEIA_FRAGMENT_MAX_SESSION_SIZE || NumFragments > THEIA_FRAGMENT_MAX_COUNT)
+	{
+		UE_LOG(LogOnline, Warning, TEXT("Session of %d bytes is too big to advertise even in fragments"), SessionLength);
+		return;
+	}
+
+	uint8 Fragment[THEIA_BEACON_MAX_DATAGRAM_SIZE];
+	StampHostResponseHeader(Fragment, ClientNonce);
+	Fragment[LAN_BEACON_PACKETTYPE1_OFFSET] = LAN_SERVER_FRAGMENT1;
+	Fragment[LAN_BEACON_PACKETTYPE2_OFFSET] = LAN_SERVER_FRAGMENT2;
+
+	// Network byte order, see FTheiaFragmentReassembler for the layout
+	uint8* FragmentHeader = &Fragment[LAN_BEACON_PACKET_HEADER_SIZE];
+	const uint32 Crc = FCrc::MemCrc32(Payload.GetData(), SessionLength);
+	FragmentHeader[0] = (uint8)(Crc >> 24);
+	FragmentHeader[1] = (uint8)(Crc >> 16);
+	FragmentHeader[2] = (uint8)(Crc >> 8);
+	FragmentHeader[3] = (uint8)Crc;
+	// The flags ride in the length the same way they do in a response entry
+	const int32 LengthField = SessionLength | PayloadRef.Flags;
+	FragmentHeader[4] = (uint8)(LengthField >> 8);
+	FragmentHeader[5] = (uint8)LengthField;
+	FragmentHeader[9] = (uint8)NumFragments;
+	for (int32 FragmentIndex = 0; FragmentIndex < NumFragments; FragmentIndex++)
+	{
+		const int32 Offset = FragmentIndex * FragmentDataSize;
+		const int32 DataLength = FMath::Min(FragmentDataSize, SessionLength - Offset);
+		FragmentHeader[6] = (uint8)(Offset >> 8);
+		FragmentHeader[7] = (uint8)Offset;
+		FragmentHeader[8] = (uint8)FragmentIndex;
+		FMemory::Memcpy(&FragmentHeader[THEIA_FRAGMENT_HEADER_SIZE], &Payload[Offset], DataLength);
+		QueueHostResponse(Beacon, Fragment, LAN_BEACON_PACKET_HEADER_SIZE + THEIA_FRAGMENT_HEADER_SIZE + DataLength);
+	}
+}
+
 /**
- * Uses the cached broadcast address to send packet to a subnet
+ * Queues a packet for the cached broadcast address. Queued packets are sent
+ * together once the current batch of received packets has been handled
  *
  * @param Packet the packet to send
  * @param Length the size of the packet to send
  */
 bool FTheiaSession::BroadcastPacket(uint8* Packet, int32 Length)
 {
-	UE_LOG(LogOnline, VeryVerbose, TEXT("BroadcastPacket: Broadcasting Packet"));
 	bool bSuccess = false;
-	if (TheiaBeacon)
+	if (HostBeacon)
 	{
-		bSuccess = TheiaBeacon->BroadcastPacket(Packet, Length);
+		bSuccess = HostBeacon->QueueBroadcastPacket(Packet, Length);
 		if (!bSuccess)
 		{
 			UE_LOG(LogOnline, Warning, TEXT("Failed to send broadcast packet %d"), (int32)ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->GetLastErrorCode());
@@ -560,13 +1384,11 @@ bool FTheiaSession::BroadcastPacket(uint8* Packet, int32 Length)
 
 bool FTheiaSession::BroadcastPacketFromSocket(uint8* Packet, int32 Length)
 {
-	UE_LOG(LogOnline, VeryVerbose, TEXT("BroadcastPacketFromSocket: LanBeacon BroadcastPacket to Session"));
-
 	bool bSuccess = false;
 
-	if (TheiaBeacon != NULL)
+	if (HostBeacon != NULL)
 	{
-		bSuccess = TheiaBeacon->BroadcastPacketFromSocket(Packet, Length);
+		bSuccess = HostBeacon->QueuePacketToSender(Packet, Length);
 		if (!bSuccess)
 		{
 			UE_LOG(LogOnline, VeryVerbose, TEXT("Failed to send broadcast packet %d"), (int32)ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->GetLastErrorCode());
@@ -587,41 +1409,8 @@ bool FTheiaSession::BroadcastPacketFromSocket(uint8* Packet, int32 Length)
  */
 bool FTheiaSession::IsValidTheiaQueryPacket(const uint8* Packet, uint32 Length, uint64& ClientNonce)
 {
-	UE_LOG(LogOnline, VeryVerbose, TEXT("IsValidLanQueryPacket: Checking is packet is valid"));
-	ClientNonce = 0;
-	bool bIsValid = false;
-	// Serialize out the data if the packet is the right size
-	if (Length == LAN_BEACON_PACKET_HEADER_SIZE)
-	{
-		FNboSerializeFromBuffer PacketReader(Packet,Length);
-		uint8 Version = 0;
-		PacketReader >> Version;
-		// Do the versions match?
-		if (Version == LAN_BEACON_PACKET_VERSION)
-		{
-			uint8 Platform = 255;
-			PacketReader >> Platform;
-			// Can we communicate with this platform?
-			if (Platform & TheiaPacketPlatformMask)
-			{
-				int32 GameId = -1;
-				PacketReader >> GameId;
-				// Is this our game?
-				if (GameId == TheiaGameUniqueId)
-				{
-					uint8 SQ1 = 0;
-					PacketReader >> SQ1;
-					uint8 SQ2 = 0;
-					PacketReader >> SQ2;
-					// Is this a server query?
-					bIsValid = (SQ1 == LAN_SERVER_QUERY1 && SQ2 == LAN_SERVER_QUERY2);
-					// Read the client nonce as the outvalue
-					PacketReader >> ClientNonce;
-				}
-			}
-		}
-	}
-	UE_LOG(LogOnline, VeryVerbose, TEXT("IsValidLanQueryPacket: packet was %s"), (bIsValid ? TEXT("Valid") : TEXT("Not Valid")));
+	const bool bIsValid = HeaderCodec.Classify(Packet, (int32)Length, TheiaNonce) == ETheiaBeaconPacketKind::Query;
+	ClientNonce = bIsValid ? FTheiaBeaconHeaderCodec::ReadNonce(Packet) : 0;
 	return bIsValid;
 }
 
@@ -635,42 +1424,7 @@ bool FTheiaSession::IsValidTheiaQueryPacket(const uint8* Packet, uint32 Length,
  */
 bool FTheiaSession::IsValidTheiaResponsePacket(const uint8* Packet, uint32 Length)
 {
-	UE_LOG(LogOnline, VeryVerbose, TEXT("IsValidLanResponsePacket: Checing is packet is valid"));
-	bool bIsValid = false;
-	// Serialize out the data if the packet is the right size
-	if (Length > LAN_BEACON_PACKET_HEADER_SIZE)
-	{
-		FNboSerializeFromBuffer PacketReader(Packet,Length);
-		uint8 Version = 0;
-		PacketReader >> Version;
-		// Do the versions match?
-		if (Version == LAN_BEACON_PACKET_VERSION)
-		{
-			uint8 Platform = 255;
-			PacketReader >> Platform;
-			// Can we communicate with this platform?
-			if (Platform & TheiaPacketPlatformMask)
-			{
-				int32 GameId = -1;
-				PacketReader >> GameId;
-				// Is this our game?
-				if (GameId == TheiaGameUniqueId)
-				{
-					uint8 SQ1 = 0;
-					PacketReader >> SQ1;
-					uint8 SQ2 = 0;
-					PacketReader >> SQ2;
-					// Is this a server response?
-					if (SQ1 == LAN_SERVER_RESPONSE1 && SQ2 == LAN_SERVER_RESPONSE2)
-					{
-						uint64 Nonce = 0;
-						PacketReader >> Nonce;
-						bIsValid = (Nonce == TheiaNonce);
-					}
-				}
-			}
-		}
-	}
-	UE_LOG(LogOnline, VeryVerbose, TEXT("IsValidLanResponsePacket: packet was %s"), (bIsValid ? TEXT("Valid") : TEXT("Not Valid")));
-	return bIsValid;
+	// Fragments are responses too, the kind says which
+	const ETheiaBeaconPacketKind::Type Kind = HeaderCodec.Classify(Packet, (int32)Length, TheiaNonce);
+	return Kind == ETheiaBeaconPacketKind::Response || Kind == ETheiaBeaconPacketKind::Fragment;
 }
@@ -4,8 +4,16 @@
 
 #include "CoreMinimal.h"
 #include "OnlineSubsystemTypes.h"
+#include "OnlineSessionSettings.h"
 #include "OnlineDelegateMacros.h"
 #include "Misc/ConfigCacheIni.h"
+#include "Misc/ScopeLock.h"
+#include "Misc/Timespan.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "HAL/ThreadSafeCounter64.h"
+#include "TheiaQueryRateLimiter.h"
+#include "TheiaFragmentReassembler.h"
 
 /**
  * This value indicates which packet version the server is sending. Clients with
@@ -14,8 +22,25 @@
  * Current format:
  *
  *	<Ver byte><Platform byte><Game unique 4 bytes><packet type 2 bytes><nonce 8 bytes><payload>
+ *
+ * Query payloads carry what the client can handle and the search filters, see FTheiaQueryFilters:
+ *
+ *	<capability byte>[<dictionary id 4 bytes>][<key table id 4 bytes>][<known count byte><session key 8 bytes>...]<filter count byte>[<key><op byte><value>]...
+ *
+ * Server response payloads pack several sessions into one datagram:
+ *
+ *	<session count byte>[<session length 2 bytes><session>]...
+ *
+ * Every session ends with its version, a varint that changes whenever the host
+ * rebuilds it. The top bit of a session's length marks it as compressed, see
+ * FTheiaCompression. The next bit marks a session the client listed as known with
+ * the same version, only <session id><version> is sent and the client reuses its copy.
+ * A session too big for a datagram of its own is sent as fragments instead, see FTheiaFragmentReassembler.
+ * Sessions are written in the compact form of NboSerializerTheia.h: varint counts,
+ * packed flags and one byte ids for well known setting keys (by name for clients with another key table). The advertised settings
+ * come behind a 2 byte length so clients can set them aside without decoding them
  */
-#define LAN_BEACON_PACKET_VERSION (uint8)10
+#define LAN_BEACON_PACKET_VERSION (uint8)19
 
 /** The size of the header for validation */
 #define LAN_BEACON_PACKET_HEADER_SIZE 16
@@ -35,14 +60,159 @@
 #define LAN_SERVER_RESPONSE1 (uint8)'S'
 #define LAN_SERVER_RESPONSE2 (uint8)'R'
 
+#define LAN_SERVER_FRAGMENT1 (uint8)'S'
+#define LAN_SERVER_FRAGMENT2 (uint8)'F'
+
+static_assert(LAN_BEACON_NONCE_OFFSET == sizeof(uint64) && LAN_BEACON_PACKET_HEADER_SIZE == LAN_BEACON_NONCE_OFFSET + sizeof(uint64),
+	"Headers are checked as two 8 byte words, the prefix in front of the nonce and the nonce");
+
+/**
+ * Places a header byte where it lands in the prefix word, the bytes in front of
+ * the nonce loaded as one uint64 in native byte order
+ */
+constexpr uint64 TheiaHeaderPrefixByte(uint8 Value, int32 Offset)
+{
+	return (uint64)Value << (PLATFORM_LITTLE_ENDIAN ? Offset * 8 : (7 - Offset) * 8);
+}
+
+/** @return the prefix word a header with these fields loads as, the game id in network byte order */
+constexpr uint64 MakeTheiaHeaderPrefix(uint8 Platform, int32 GameId, uint8 Type1, uint8 Type2)
+{
+	return TheiaHeaderPrefixByte(LAN_BEACON_PACKET_VERSION, LAN_BEACON_VER_OFFSET) |
+		TheiaHeaderPrefixByte(Platform, LAN_BEACON_PLATFORM_OFFSET) |
+		TheiaHeaderPrefixByte((uint8)((uint32)GameId >> 24), LAN_BEACON_GAMEID_OFFSET) |
+		TheiaHeaderPrefixByte((uint8)((uint32)GameId >> 16), LAN_BEACON_GAMEID_OFFSET + 1) |
+		TheiaHeaderPrefixByte((uint8)((uint32)GameId >> 8), LAN_BEACON_GAMEID_OFFSET + 2) |
+		TheiaHeaderPrefixByte((uint8)GameId, LAN_BEACON_GAMEID_OFFSET + 3) |
+		TheiaHeaderPrefixByte(Type1, LAN_BEACON_PACKETTYPE1_OFFSET) |
+		TheiaHeaderPrefixByte(Type2, LAN_BEACON_PACKETTYPE2_OFFSET);
+}
+
+/** Clears the platform byte of a prefix word, it is tested against a mask rather than matched */
+constexpr uint64 TheiaHeaderPrefixCompareMask = ~TheiaHeaderPrefixByte(0xff, LAN_BEACON_PLATFORM_OFFSET);
+
+/** Online hosts listen for queries this many ports above their game port */
+#define THEIA_BEACON_PORT_OFFSET 1
+
+/** Default multicast group and TTL used when bUseMulticast is set */
+#define THEIA_MULTICAST_GROUP TEXT("239.255.14.1")
+#define THEIA_MULTICAST_TTL 1
+
+/** Default number of datagrams drained or sent per batch */
+#define THEIA_BEACON_BATCH_SIZE 16
+
+/** Largest datagram the beacon sends or receives, a 1500 byte Ethernet MTU minus the IPv4 and UDP headers */
+#define THEIA_BEACON_MAX_DATAGRAM_SIZE 1472
+
+/** Size of the session count that follows the header of a server response */
+#define THEIA_RESPONSE_COUNT_SIZE 1
+
+/** Size of the length prefix in front of each session packed into a server response */
+#define THEIA_RESPONSE_ENTRY_HEADER_SIZE 2
+
+/** Set in a session's length prefix when the session is compressed, see FTheiaCompression */
+#define THEIA_RESPONSE_COMPRESSED_FLAG 0x8000
+
+/** Set in a session's length prefix when only its id and version follow, the client has the rest */
+#define THEIA_RESPONSE_UNCHANGED_FLAG 0x4000
+
+/** Bits of a session's length prefix holding the length itself */
+#define THEIA_RESPONSE_LENGTH_MASK THEIA_FRAGMENT_SESSION_LENGTH_MASK
+
 class FInternetAddr;
 class FNboSerializeToBuffer;
 
+/**
+ * How a beacon socket was set up. An open socket is only reused for the same setup
+ */
+namespace ETheiaBeaconSocketType
+{
+	enum Type
+	{
+		/** Bound to the LAN announce port, used for both hosting and searching */
+		Lan,
+		/** Bound just above the game port, answers online queries */
+		OnlineHost,
+		/** Bound to the client port, sends queries to a known host */
+		OnlineClient,
+		/** Number of socket types */
+		Count
+	};
+}
+
+/**
+ * A host queried directly by an online search
+ */
+struct FTheiaHostEndpoint
+{
+	/** Host address in text form, IPv4 or IPv6 */
+	FString Address;
+	/** Host game port, its beacon listens just above it */
+	int32 Port;
+
+	FTheiaHostEndpoint() :
+		Port(0)
+	{
+	}
+
+	FTheiaHostEndpoint(const FString& InAddress, int32 InPort) :
+		Address(InAddress),
+		Port(InPort)
+	{
+	}
+};
+
+/**
+ * A hosted session as published to the beacon thread
+ */
+struct FTheiaHostedPayload
+{
+	/** Serialized session details (without header) */
+	TArray<uint8> Payload;
+	/** Payload compressed for clients that accept it, empty when that would not save anything */
+	TArray<uint8> CompressedPayload;
+	/** Session id and version, sent to clients that already have this version */
+	TArray<uint8> UnchangedPayload;
+	/** Payload with every setting key by name, sent to clients whose setting key table differs */
+	TArray<uint8> ByNamePayload;
+	/** Key clients list this version of the session under, see FTheiaQueryFilters::MakeSessionVersionKey */
+	uint64 VersionKey;
+	/** Settings the query filters are evaluated against */
+	FOnlineSessionSettings Settings;
+	/** Public slots still open in the session */
+	int32 NumOpenPublicConnections;
+
+	FTheiaHostedPayload() :
+		VersionKey(0),
+		NumOpenPublicConnections(0)
+	{
+	}
+};
+
+/**
+ * Preallocated slot for a datagram received from, or waiting to be sent to, an address
+ */
+struct FTheiaBeaconPacket
+{
+	/** Raw datagram contents */
+	uint8 Data[THEIA_BEACON_MAX_DATAGRAM_SIZE];
+	/** Number of valid bytes in Data */
+	int32 Length;
+	/** Where the datagram came from or is going to */
+	TSharedRef<FInternetAddr> Addr;
+
+	FTheiaBeaconPacket(const TSharedRef<FInternetAddr>& InAddr) :
+		Length(0),
+		Addr(InAddr)
+	{
+	}
+};
+
 // LAN Session Delegates
 DECLARE_MULTICAST_DELEGATE_ThreeParams(FOnValidQueryPacket, uint8*, int32, uint64);
 typedef FOnValidQueryPacket::FDelegate FOnValidQueryPacketDelegate;
 
-DECLARE_MULTICAST_DELEGATE_TwoParams(FOnValidResponsePacket, uint8*, int32);
+DECLARE_MULTICAST_DELEGATE_ThreeParams(FOnValidResponsePacket, uint8*, int32, const FInternetAddr&);
 typedef FOnValidResponsePacket::FDelegate FOnValidResponsePacketDelegate;
 
 DECLARE_MULTICAST_DELEGATE(FOnSearchingTimeout);
@@ -64,16 +234,53 @@ class ONLINESUBSYSTEMTHEIA_API FTheiaBeacon
 	class FSocket* ListenSocket;
 	/** The address in bound requests come in on */
 	TSharedPtr<class FInternetAddr> ListenAddr;
-	/** Temporary address when receiving packets*/
+	/** Temporary address when receiving packets, also where replies are sent to */
 	TSharedRef<class FInternetAddr> SockAddr;
+	/** Ring of datagrams filled by ReceivePacketBatch */
+	TArray<FTheiaBeaconPacket> ReceiveRing;
+	/** Ring of datagrams queued for the next FlushPendingPackets */
+	TArray<FTheiaBeaconPacket> SendRing;
+	/** Number of SendRing entries waiting to be sent */
+	int32 NumPendingSends;
+	/** Whether the socket is watched by the shared readiness poller */
+	bool bUsesReadinessPolling;
+	/** Set by the readiness poller when the socket has data waiting */
+	FThreadSafeBool bIsReadable;
+	/** Port the socket was asked to bind to, BindNextPort may have picked another */
+	int32 RequestedPort;
+	/** Beacon addresses of the hosts a client socket sends its queries to, every probed port of each */
+	TArray<TSharedRef<FInternetAddr>> HostAddrs;
+
+	/**
+	 * Copies a packet into the send ring, flushing first if the ring is full
+	 *
+	 * @return true if the packet was queued
+	 */
+	bool QueuePacket(const uint8* Packet, int32 Length, const FInternetAddr& Destination);
 
 public:
-	/** Sets the broadcast address for this object */
-	FTheiaBeacon();
+	/**
+	 * Sets the broadcast address for this object
+	 *
+	 * @param BatchSize the number of datagrams received or sent per batch
+	 */
+	FTheiaBeacon(int32 BatchSize = THEIA_BEACON_BATCH_SIZE);
 
 	/** Frees the broadcast socket */
 	virtual ~FTheiaBeacon();
 
+	/**
+	 * Copies one address into another without going through a 32 bit IPv4 form,
+	 * so IPv6 addresses survive the copy
+	 *
+	 * @param Dest the address to overwrite
+	 * @param Source the address to copy
+	 */
+	static void CopyAddr(FInternetAddr& Dest, const FInternetAddr& Source);
+
+	/** @return a new address equal to Source, of either family */
+	static TSharedRef<FInternetAddr> CloneAddr(const FInternetAddr& Source);
+
 	/** Return true if there is a valid ListenSocket */
 	bool IsListenSocketValid() const;
 
@@ -81,10 +288,12 @@ public:
 	 * Initializes the socket
 	 *
 	 * @param Port the port to listen on
+	 * @param MulticastGroup group to join and send to instead of broadcasting, 0 to broadcast
+	 * @param MulticastTtl how many router hops multicast packets may cross
 	 *
 	 * @return true if both socket was created successfully, false otherwise
 	 */
-	bool Init(int32 Port);
+	bool Init(int32 Port, uint32 MulticastGroup = 0, int32 MulticastTtl = THEIA_MULTICAST_TTL);
 
 	/**
 	* Initializes the socket for host in online connection
@@ -95,14 +304,55 @@ public:
 	*/
 	bool InitHost(int32 Port);
 
+	/**
+	 * Initializes one more socket on a port an online host beacon is already bound
+	 * to. The OS spreads incoming queries over every socket sharing the port
+	 *
+	 * @param Port the port the host beacon ended up bound to
+	 *
+	 * @return true if the socket was created and bound to exactly that port
+	 */
+	bool InitHostShard(int32 Port);
+
 	/**
 	* Initializes the socket for the client in online connection
 	*
-	* @param Port the port to listen on
+	* @param Hosts the hosts every query is sent to
+	* @param ListenPort the port to listen on
+	* @param PortRange the number of consecutive beacon ports probed on each host
 	*
 	* @return true if both socket was created successfully, false otherwise
 	*/
-	bool InitClient(int32 IP, int32 Port, int32 ListenPort);
+	bool InitClient(const TArray<FTheiaHostEndpoint>& Hosts, int32 ListenPort, int32 PortRange = 1);
+
+	/**
+	 * Checks whether the open socket was set up with the given listen port, in
+	 * which case it can be reused instead of binding a new one
+	 *
+	 * @param Port the port the caller wants to listen on
+	 *
+	 * @return true if the socket is open and was bound for that port
+	 */
+	bool IsBoundFor(int32 Port) const
+	{
+		return ListenSocket != NULL && RequestedPort == Port;
+	}
+
+	/** @return the port the socket is actually bound to, 0 if it is not open */
+	int32 GetBoundPort() const
+	{
+		return ListenAddr.IsValid() ? ListenAddr->GetPort() : 0;
+	}
+
+	/**
+	 * Points queries from a client socket at other hosts without rebinding. A host
+	 * whose beacon port was taken binds the next free one, so each host can be
+	 * probed on a range of ports starting at its usual beacon port
+	 *
+	 * @param Hosts the hosts every query is sent to
+	 * @param PortRange the number of consecutive beacon ports probed on each host
+	 */
+	void SetHostAddrs(const TArray<FTheiaHostEndpoint>& Hosts, int32 PortRange = 1);
 
 	/**
 	 * Called to poll the socket for pending data. Any data received is placed
@@ -116,10 +366,118 @@ public:
 	int32 ReceivePacket(uint8* PacketData, int32 BufferSize);
 
 	/**
-	 * Uses the cached broadcast address to send packet to a subnet
+	 * Blocks until the socket has data to read or the wait time elapses
+	 *
+	 * @param WaitTime the maximum amount of time to block
+	 *
+	 * @return true if there is data waiting to be read, false otherwise
+	 */
+	bool WaitForData(const FTimespan& WaitTime);
+
+	/**
+	 * Registers the socket with the shared readiness poller so callers can skip
+	 * reading while nothing is pending
+	 *
+	 * @return true if the socket is now watched by the poller
+	 */
+	bool EnableReadinessPolling();
+
+	/** Stops the shared readiness poller watching the socket, once another thread services it */
+	void DisableReadinessPolling();
+
+	/** @return true if the socket is watched by the shared readiness poller */
+	bool UsesReadinessPolling() const
+	{
+		return bUsesReadinessPolling;
+	}
+
+	/**
+	 * Clears the readable flag set by the readiness poller. Callers must drain
+	 * the socket whenever this returns true
+	 *
+	 * @return true if the poller saw pending data since the last call
+	 */
+	bool ConsumeReadiness();
+
+	/** @return true if the readiness poller flagged pending data that has not been consumed yet */
+	bool IsMarkedReadable() const
+	{
+		return bIsReadable;
+	}
+
+	/** @return the socket the readiness poller waits on, NULL if there is none */
+	class FSocket* GetSocket() const
+	{
+		return ListenSocket;
+	}
+
+	/** Called by the readiness poller when the socket has data waiting */
+	void MarkReadable()
+	{
+		bIsReadable = true;
+	}
+
+	/**
+	 * Drains pending datagrams from the socket into the preallocated receive ring
+	 *
+	 * @return the number of datagrams received, GetBatchSize() if more may be pending
+	 */
+	int32 ReceivePacketBatch();
+
+	/**
+	 * @param Index the index of a datagram filled in by the last ReceivePacketBatch
+	 *
+	 * @return the received datagram
+	 */
+	FTheiaBeaconPacket& GetReceivedPacket(int32 Index)
+	{
+		return ReceiveRing[Index];
+	}
+
+	/** @return the number of datagrams received or sent per batch */
+	int32 GetBatchSize() const
+	{
+		return ReceiveRing.Num();
+	}
+
+	/**
+	 * Sets the address that BroadcastPacketFromSocket and QueuePacketToSender reply to
+	 *
+	 * @param Addr the address of the sender being answered
+	 */
+	void SetReplyAddr(const FInternetAddr& Addr);
+
+	/**
+	 * Queues a packet for the cached broadcast address, sent by FlushPendingPackets
+	 *
+	 * @param Packet the packet to send
+	 * @param Length the size of the packet to send
+	 */
+	bool QueueBroadcastPacket(const uint8* Packet, int32 Length);
+
+	/**
+	 * Queues a packet for the reply address, sent by FlushPendingPackets
+	 *
+	 * @param Packet the packet to send
+	 * @param Length the size of the packet to send
+	 */
+	bool QueuePacketToSender(const uint8* Packet, int32 Length);
+
+	/**
+	 * Sends every queued packet
+	 *
+	 * @return the number of packets sent successfully
+	 */
+	int32 FlushPendingPackets();
+
+	/**
+	 * Uses the cached broadcast address to send packet to a subnet. A client
+	 * socket sends it to each of its hosts back to back instead
 	 *
 	 * @param Packet the packet to send
 	 * @param Length the size of the packet to send
+	 *
+	 * @return true if the packet reached the subnet or at least one host
 	 */
 	bool BroadcastPacket(uint8* Packet, int32 Length);
 
@@ -135,16 +493,189 @@ public:
 DEFINE_ONLINE_DELEGATE_ONE_PARAM(OnPortChanged, int32)
 };
 
+/** What a received datagram is, going by its header */
+namespace ETheiaBeaconPacketKind
+{
+	enum Type
+	{
+		/** Too short, or not from this game and packet version */
+		Invalid,
+		/** A client's server query */
+		Query,
+		/** A server response answering our query */
+		Response,
+		/** A fragment of a server response answering our query */
+		Fragment
+	};
+}
+
+/**
+ * Checks beacon headers without a serializer. The bytes in front of the nonce only
+ * take one value per packet type for a game, so each packet's are loaded as one word
+ * and compared against prefixes built once from the game id
+ */
+class FTheiaBeaconHeaderCodec
+{
+public:
+
+	FTheiaBeaconHeaderCodec() :
+		QueryPrefix(0),
+		ResponsePrefix(0),
+		FragmentPrefix(0),
+		PlatformMask(0)
+	{
+	}
+
+	/**
+	 * Builds the expected prefixes, needed again whenever the game id or platform mask changes
+	 *
+	 * @param GameUniqueId the game id packets have to carry
+	 * @param InPlatformMask the platforms we can communicate with
+	 */
+	void Configure(int32 GameUniqueId, int32 InPlatformMask)
+	{
+		QueryPrefix = MakeTheiaHeaderPrefix(0, GameUniqueId, LAN_SERVER_QUERY1, LAN_SERVER_QUERY2);
+		ResponsePrefix = MakeTheiaHeaderPrefix(0, GameUniqueId, LAN_SERVER_RESPONSE1, LAN_SERVER_RESPONSE2);
+		FragmentPrefix = MakeTheiaHeaderPrefix(0, GameUniqueId, LAN_SERVER_FRAGMENT1, LAN_SERVER_FRAGMENT2);
+		PlatformMask = (uint8)InPlatformMask;
+	}
+
+	/**
+	 * @param Packet the received datagram
+	 * @param Length the size of the datagram
+	 * @param ExpectedNonce the nonce responses and fragments have to answer
+	 *
+	 * @return the kind of packet, responses and fragments also need a payload behind the header
+	 */
+	ETheiaBeaconPacketKind::Type Classify(const uint8* Packet, int32 Length, uint64 ExpectedNonce) const
+	{
+		if (Length < LAN_BEACON_PACKET_HEADER_SIZE || (Packet[LAN_BEACON_PLATFORM_OFFSET] & PlatformMask) == 0)
+		{
+			return ETheiaBeaconPacketKind::Invalid;
+		}
+
+		// A single unaligned load
+		uint64 Prefix;
+		FMemory::Memcpy(&Prefix, Packet, sizeof(Prefix));
+		Prefix &= TheiaHeaderPrefixCompareMask;
+		ETheiaBeaconPacketKind::Type Kind = ETheiaBeaconPacketKind::Invalid;
+		if (Prefix == QueryPrefix)
+		{
+			return ETheiaBeaconPacketKind::Query;
+		}
+		else if (Prefix == ResponsePrefix)
+		{
+			Kind = ETheiaBeaconPacketKind::Response;
+		}
+		else if (Prefix == FragmentPrefix)
+		{
+			Kind = ETheiaBeaconPacketKind::Fragment;
+		}
+		else
+		{
+			return ETheiaBeaconPacketKind::Invalid;
+		}
+		// Only answers to our own query are of any use
+		return (Length > LAN_BEACON_PACKET_HEADER_SIZE && ReadNonce(Packet) == ExpectedNonce) ? Kind : ETheiaBeaconPacketKind::Invalid;
+	}
+
+	/**
+	 * Classifies every datagram of a received batch up front, keeping the header checks in one loop
+	 *
+	 * @param Beacon the beacon whose last ReceivePacketBatch filled the datagrams
+	 * @param NumPackets the number of datagrams received
+	 * @param ExpectedNonce the nonce responses and fragments have to answer
+	 * @param OutKinds receives the kind of each datagram
+	 */
+	void ClassifyBatch(FTheiaBeacon& Beacon, int32 NumPackets, uint64 ExpectedNonce, ETheiaBeaconPacketKind::Type* OutKinds) const
+	{
+		for (int32 PacketIndex = 0; PacketIndex < NumPackets; PacketIndex++)
+		{
+			const FTheiaBeaconPacket& Received = Beacon.GetReceivedPacket(PacketIndex);
+			OutKinds[PacketIndex] = Classify(Received.Data, Received.Length, ExpectedNonce);
+		}
+	}
+
+	/** @return the nonce of a header, kept in network byte order */
+	static uint64 ReadNonce(const uint8* Packet)
+	{
+		uint64 Nonce = 0;
+		for (int32 ByteIndex = 0; ByteIndex < LAN_BEACON_PACKET_HEADER_SIZE - LAN_BEACON_NONCE_OFFSET; ByteIndex++)
+		{
+			Nonce = (Nonce << 8) | Packet[LAN_BEACON_NONCE_OFFSET + ByteIndex];
+		}
+		return Nonce;
+	}
+
+private:
+
+	/** Prefix words of each packet type for our game, platform byte cleared */
+	uint64 QueryPrefix;
+	uint64 ResponsePrefix;
+	uint64 FragmentPrefix;
+
+	/** Platforms we can communicate with */
+	uint8 PlatformMask;
+};
+
+/** Kinds of the datagrams of one received batch */
+typedef TArray<ETheiaBeaconPacketKind::Type, TInlineAllocator<THEIA_BEACON_BATCH_SIZE>> FTheiaBeaconPacketKinds;
+
 #define LAN_ANNOUNCE_PORT 14001
 #define LAN_UNIQUE_ID 9999
 #define LAN_QUERY_TIMEOUT 5
+
+/** Port of a search host that is named without one */
+#define THEIA_DEFAULT_SEARCH_HOST_PORT 7777
+
+/** Default and largest number of consecutive beacon ports an online search probes on each host */
+#define THEIA_SEARCH_PORT_RANGE 1
+#define THEIA_SEARCH_MAX_PORT_RANGE 64
+
+/** Default shortest time a search runs before it may finish early on a quiet network */
+#define THEIA_SEARCH_MIN_TIME 0.25f
+
+/** Default number of times a search query is sent again in case it was dropped */
+#define THEIA_SEARCH_RETRANSMIT_COUNT 2
+
+/** Default delay before the first query retransmit, doubled after each one */
+#define THEIA_SEARCH_RETRANSMIT_DELAY 0.2f
 #define LAN_PLATFORMMASK 0xffffffff
+#define THEIA_BEACON_THREAD_QUEUE_SIZE 256
+
+/** Most sockets an online host may spread its beacon port over */
+#define THEIA_HOST_MAX_LISTEN_SHARDS 16
 
 /**
  *	Encapsulate functionality related to LAN broadcast data
  */
 class ONLINESUBSYSTEMTHEIA_API FTheiaSession
 {
+	friend class FTheiaBeaconThread;
+
+public:
+
+	/** Session payloads the beacon thread answers queries with, shared read-only across threads */
+	typedef TSharedPtr<const TArray<FTheiaHostedPayload>, ESPMode::ThreadSafe> FHostedPayloadsPtr;
+
+	/** A serialized session to answer a query with */
+	struct FSessionPayloadRef
+	{
+		/** The session in the form given by Flags */
+		const TArray<uint8>* Payload;
+		/** THEIA_RESPONSE_*_FLAG bits set in the session's length prefix */
+		int32 Flags;
+
+		FSessionPayloadRef(const TArray<uint8>* InPayload, int32 InFlags) :
+			Payload(InPayload),
+			Flags(InFlags)
+		{
+		}
+	};
+
+	/** Serialized sessions to answer a query with, see QueueHostResponses */
+	typedef TArray<FSessionPayloadRef, TInlineAllocator<8>> FSessionPayloadList;
+
 protected:
 	/**
 	 * Determines if the packet header is valid or not
@@ -166,21 +697,187 @@ protected:
 	 */
 	bool IsValidTheiaResponsePacket(const uint8* Packet, uint32 Length);
 
+	/**
+	 * Checks a valid query against its source's rate limit before any work is done
+	 * answering it. Called from whichever thread services the beacon
+	 *
+	 * @param Source the address the query came from
+	 *
+	 * @return true if the query should be answered, false if it was dropped
+	 */
+	bool AllowQuery(const FInternetAddr& Source);
+
+	/**
+	 * Creates a beacon with the configured batch size
+	 *
+	 * @return the new beacon, its socket is not set up yet
+	 */
+	FTheiaBeacon* NewBeacon() const;
+
+	/**
+	 * Sets up how a beacon is polled for its current roles: by a dedicated thread,
+	 * through the shared readiness poller, or by reading the socket every tick.
+	 * Must be called whenever a role using the beacon starts or stops
+	 *
+	 * @param Beacon the beacon whose roles changed
+	 */
+	void RestartPolling(FTheiaBeacon* Beacon);
+
+	/**
+	 * Drains a beacon socket and dispatches valid packets by type, queries to the
+	 * hosting role and responses to the searching role
+	 *
+	 * @param Beacon the beacon to read from
+	 */
+	void ReceivePackets(FTheiaBeacon& Beacon);
+
+	/**
+	 * Counts down an active search, resending the query as scheduled, and fires the
+	 * timeout delegates when it expires or once responses have stopped arriving for SearchQuietPeriod
+	 */
+	void TickSearchTimeout(float DeltaTime);
+
+	/**
+	 * Stops the thread servicing a beacon (if any) and waits for it to release the beacon.
+	 * Responses it had queued are delivered while the beacon still collects them
+	 *
+	 * @param SocketType the socket type of the beacon
+	 */
+	void StopBeaconThread(int32 SocketType);
+
+	/**
+	 * Returns the open socket for the given setup, only creating and binding a new
+	 * one when none is open for that port yet
+	 *
+	 * @param SocketType how the socket is set up
+	 * @param ListenPort the port to listen on
+	 * @param Hosts the hosts to query (OnlineClient only)
+	 *
+	 * @return the beacon, NULL if the socket could not be set up
+	 */
+	FTheiaBeacon* PrepareBeacon(ETheiaBeaconSocketType::Type SocketType, int32 ListenPort, const TArray<FTheiaHostEndpoint>& Hosts = TArray<FTheiaHostEndpoint>());
+
+	/** Closes every open beacon socket */
+	void DestroyBeacons();
+
+	/**
+	 * Opens the extra sockets sharing the online host beacon's port, up to HostListenShards in all
+	 *
+	 * @param InHostBeacon the online host beacon, already bound
+	 */
+	void OpenHostShards(const FTheiaBeacon& InHostBeacon);
+
+	/** Stops the shard threads and closes the extra host sockets */
+	void CloseHostShards();
+
+	/** Starts a thread answering queries on each extra host socket, a shard whose thread fails is closed */
+	void StartHostShardThreads();
+
+	/** Stops the shard threads and waits for them to release their sockets */
+	void StopHostShardThreads();
+
+	/** @return the multicast group LAN beacons use, 0 to broadcast */
+	uint32 GetMulticastGroupIp() const;
+
+	/** @return the socket type slot holding the beacon, INDEX_NONE if it is not one of ours */
+	int32 GetBeaconSocketType(const FTheiaBeacon* Beacon) const;
+
+	/** @return true if the hosting role answers queries arriving on the beacon */
+	bool IsAnsweringQueries(const FTheiaBeacon* Beacon) const
+	{
+		return bIsHosting && HostBeacon == Beacon;
+	}
+
+	/** @return true if the searching role collects responses arriving on the beacon */
+	bool IsCollectingResponses(const FTheiaBeacon* Beacon) const
+	{
+		return bIsSearching && SearchBeacon == Beacon;
+	}
+
+	/**
+	 * Queues one response datagram, broadcast when hosting on LAN, otherwise sent to the querying socket
+	 *
+	 * @param Beacon the beacon to queue the response on
+	 * @param Response the datagram with its header stamped
+	 * @param Length the size of the datagram
+	 */
+	void QueueHostResponse(FTheiaBeacon& Beacon, const uint8* Response, int32 Length) const;
+
+	/**
+	 * Splits a session too big for a response datagram into fragments and queues them
+	 *
+	 * @param Beacon the beacon to queue the fragments on
+	 * @param PayloadRef the serialized session
+	 * @param ClientNonce the nonce sent by the querying client
+	 */
+	void QueueSessionFragments(FTheiaBeacon& Beacon, const FSessionPayloadRef& PayloadRef, uint64 ClientNonce) const;
+
+	/** Checks the headers of received packets, built from TheiaGameUniqueId and TheiaPacketPlatformMask */
+	FTheiaBeaconHeaderCodec HeaderCodec;
+
+	/** Kinds of the packets of the batch being handled on the game thread */
+	FTheiaBeaconPacketKinds ReceivedPacketKinds;
+
+	/** Reassembles fragmented sessions received on the game thread */
+	FTheiaFragmentReassembler FragmentReassembler;
+
+	/** Holds a session completed by FragmentReassembler while it is handed out */
+	TArray<uint8> ReassembledResponse;
+
+	/** Beacon answering queries while hosting */
+	class FTheiaBeacon* HostBeacon;
+
+	/** Beacon sending queries and collecting responses while searching, may be HostBeacon */
+	class FTheiaBeacon* SearchBeacon;
+
+	/** Whether queries are being answered */
+	bool bIsHosting;
+
+	/** Whether a search is in progress */
+	bool bIsSearching;
+
+	/** Whether the hosting role broadcasts its responses (LAN) or sends them to the querying socket */
+	bool bIsHostingLAN;
+
+	/** Runnables servicing each open beacon when bUseBeaconThread is set, by socket type */
+	class FTheiaBeaconThread* BeaconThreadRunnables[ETheiaBeaconSocketType::Count];
+
+	/** Threads running BeaconThreadRunnables, by socket type */
+	class FRunnableThread* BeaconThreads[ETheiaBeaconSocketType::Count];
+
+	/** Guards HostedPayloads, which is read by the beacon thread */
+	mutable FCriticalSection HostedPayloadsLock;
+
+	/** Serialized session details (without header) used by the beacon thread to answer queries */
+	FHostedPayloadsPtr HostedPayloads;
+
+	/** Queries dropped because their source was over its rate limit */
+	FThreadSafeCounter NumRateLimitedQueries;
+
+	/** Bumped after each publish, lets beacon threads skip the lock while HostedPayloads is unchanged */
+	FThreadSafeCounter HostedPayloadsSerial;
+
+	/** Extra sockets sharing the online host beacon's port, each serviced by its own thread */
+	TArray<class FTheiaBeacon*> HostShardBeacons;
+
+	/** Runnables answering queries on HostShardBeacons */
+	TArray<class FTheiaBeaconThread*> HostShardRunnables;
+
+	/** Threads running HostShardRunnables */
+	TArray<class FRunnableThread*> HostShardThreads;
+
 public:
 
 	/** Port to listen on for LAN queries/responses */
 	int32 TheiaAnnouncePort;
 
-	/** IP to listen on as online host*/
-	int32 HostSessionAddr;
-
-	/** Port to listen on as online host */
-	int32 HostSessionPort;
+	/** Hosts an online search sends its query to, all at once */
+	TArray<FTheiaHostEndpoint> SearchHosts;
 
 	/** Port to listen on as a client */
 	int32 ClientSessionPort;
 
-	/** Is it a match over LAN*/
+	/** Is the search over LAN, hosting keeps track of its own setup */
 	bool IsLANMatch;
 
 	/** Unique id to keep UE3 games from seeing each others' LAN packets */
@@ -192,29 +889,139 @@ public:
 	/** The amount of time to wait before timing out a LAN query request */
 	float TheiaQueryTimeout;
 
-	/** LAN beacon for packet broadcast */
-	class FTheiaBeacon* TheiaBeacon;
-
-	/** State of the LAN beacon */
-	ELanBeaconState::Type TheiaBeaconState;
+	/** Open sockets by setup, kept for the lifetime of the session manager so switching roles never rebinds */
+	class FTheiaBeacon* Beacons[ETheiaBeaconSocketType::Count];
 
 	/** Used by a client to uniquely identify itself during LAN match discovery */
 	uint64 TheiaNonce;
 
+	/**
+	 * TheiaNonce while a search is in progress, 0 otherwise. Beacon threads read
+	 * this instead of TheiaNonce and bIsSearching, which only the game thread may touch
+	 */
+	FThreadSafeCounter64 ActiveSearchNonce;
+
 	/** The amount of time before the LAN query is considered done */
 	float TheiaQueryTimeLeft;
 
+	/** Time spent in the current search */
+	float TheiaSearchTime;
+
+	/** Time since the current search last received a valid response or sent its query */
+	float TheiaSearchQuietTime;
+
+	/** Query sent by the current search, kept for retransmits */
+	TArray<uint8> TheiaQueryPacket;
+
+	/** Retransmits left in the current search */
+	int32 TheiaQueryRetransmitsLeft;
+
+	/** Search time at which the query is sent again */
+	float TheiaNextRetransmitTime;
+
+	/** Delay until the retransmit after the next one */
+	float TheiaRetransmitDelay;
+
+	/** Platform time at which the current search first sent its query, retransmits leave it alone */
+	double TheiaQuerySentTime;
+
+	/** Whether the beacon socket is serviced by a dedicated thread instead of the game thread */
+	bool bUseBeaconThread;
+
+	/** Maximum number of finished events the beacon thread can queue for the game thread */
+	int32 BeaconThreadQueueSize;
+
+	/** Number of datagrams the beacon drains or sends per batch */
+	int32 BeaconBatchSize;
+
+	/** Whether the game thread only reads the socket once the readiness poller has seen data */
+	bool bUseReadinessPolling;
+
+	/** Largest server response datagram this host sends, raise it on networks known to carry bigger datagrams */
+	int32 MaxResponseDatagramSize;
+
+	/** A search finishes once no response arrived for this long (0 waits out TheiaQueryTimeout) */
+	float SearchQuietPeriod;
+
+	/** Shortest time a search runs before the quiet period may finish it */
+	float SearchMinTime;
+
+	/** Number of times a search sends its query again, with exponential backoff */
+	int32 SearchRetransmitCount;
+
+	/** Delay before the first query retransmit */
+	float SearchRetransmitDelay;
+
+	/** Number of consecutive beacon ports an online search probes on each host */
+	int32 SearchPortRange;
+
+	/** Whether search results keep their advertised settings undecoded until they reach game code */
+	bool bLazySearchResultSettings;
+
+	/** Whether LAN queries and responses go to a multicast group rather than the subnet broadcast address */
+	bool bUseMulticast;
+
+	/** Multicast group LAN beacons join, "a.b.c.d" */
+	FString MulticastGroup;
+
+	/** How many router hops multicast packets may cross */
+	int32 MulticastTtl;
+
+	/** Whether hosts also keep a compressed copy of each session for clients that accept one */
+	bool bCompressSessions;
+
+	/** Number of sockets an online host opens on its beacon port, each answering queries on its own thread */
+	int32 HostListenShards;
+
+	/** Sustained queries per second answered for one source address, 0 answers everything */
+	float QueryRateLimit;
+
+	/** Queries one source address may send back to back before QueryRateLimit applies */
+	float QueryRateBurst;
+
+	/** Per source limits on the queries answered, shared by every socket and shard */
+	FTheiaQueryRateLimiter QueryRateLimiter;
+
 	FTheiaSession() :
+		HostBeacon(NULL),
+		SearchBeacon(NULL),
+		bIsHosting(false),
+		bIsSearching(false),
+		bIsHostingLAN(false),
 		TheiaAnnouncePort(LAN_ANNOUNCE_PORT),
 		TheiaGameUniqueId(LAN_UNIQUE_ID),
 		TheiaPacketPlatformMask(LAN_PLATFORMMASK),
 		TheiaQueryTimeout(LAN_QUERY_TIMEOUT),
-		TheiaBeacon(NULL),
-		TheiaBeaconState(ELanBeaconState::NotUsingLanBeacon),
 		TheiaNonce(0),
 		TheiaQueryTimeLeft(0.0f),
-		HostSessionAddr(0)
+		TheiaSearchTime(0.0f),
+		TheiaSearchQuietTime(0.0f),
+		TheiaQueryRetransmitsLeft(0),
+		TheiaNextRetransmitTime(0.0f),
+		TheiaRetransmitDelay(0.0f),
+		TheiaQuerySentTime(0.0),
+		bUseBeaconThread(false),
+		BeaconThreadQueueSize(THEIA_BEACON_THREAD_QUEUE_SIZE),
+		BeaconBatchSize(THEIA_BEACON_BATCH_SIZE),
+		bUseReadinessPolling(false),
+		MaxResponseDatagramSize(LAN_BEACON_MAX_PACKET_SIZE),
+		SearchQuietPeriod(0.0f),
+		SearchMinTime(THEIA_SEARCH_MIN_TIME),
+		SearchRetransmitCount(THEIA_SEARCH_RETRANSMIT_COUNT),
+		SearchRetransmitDelay(THEIA_SEARCH_RETRANSMIT_DELAY),
+		SearchPortRange(THEIA_SEARCH_PORT_RANGE),
+		bLazySearchResultSettings(false),
+		bUseMulticast(false),
+		MulticastGroup(THEIA_MULTICAST_GROUP),
+		MulticastTtl(THEIA_MULTICAST_TTL),
+		bCompressSessions(false),
+		HostListenShards(1),
+		QueryRateLimit(THEIA_QUERY_RATE_LIMIT),
+		QueryRateBurst(THEIA_QUERY_RATE_BURST)
 	{
+		FMemory::Memzero(Beacons);
+		FMemory::Memzero(BeaconThreadRunnables);
+		FMemory::Memzero(BeaconThreads);
 		if (!GConfig->GetInt(TEXT("LANSession"), TEXT("LanAnnouncePort"), TheiaAnnouncePort, GEngineIni))
 		{
 			TheiaAnnouncePort = LAN_ANNOUNCE_PORT;
@@ -223,11 +1030,43 @@ public:
 		{
 			TheiaGameUniqueId = LAN_UNIQUE_ID;
 		}
+		HeaderCodec.Configure(TheiaGameUniqueId, TheiaPacketPlatformMask);
+		GConfig->GetBool(TEXT("LANSession"), TEXT("bUseBeaconThread"), bUseBeaconThread, GEngineIni);
+		if (!GConfig->GetInt(TEXT("LANSession"), TEXT("BeaconThreadQueueSize"), BeaconThreadQueueSize, GEngineIni))
+		{
+			BeaconThreadQueueSize = THEIA_BEACON_THREAD_QUEUE_SIZE;
+		}
+		if (!GConfig->GetInt(TEXT("LANSession"), TEXT("BeaconBatchSize"), BeaconBatchSize, GEngineIni))
+		{
+			BeaconBatchSize = THEIA_BEACON_BATCH_SIZE;
+		}
+		GConfig->GetBool(TEXT("LANSession"), TEXT("bUseReadinessPolling"), bUseReadinessPolling, GEngineIni);
+		GConfig->GetInt(TEXT("LANSession"), TEXT("BeaconMaxDatagramSize"), MaxResponseDatagramSize, GEngineIni);
+		MaxResponseDatagramSize = FMath::Clamp(MaxResponseDatagramSize, (int32)LAN_BEACON_MAX_PACKET_SIZE, (int32)THEIA_BEACON_MAX_DATAGRAM_SIZE);
+		GConfig->GetFloat(TEXT("LANSession"), TEXT("SearchMaxTime"), TheiaQueryTimeout, GEngineIni);
+		GConfig->GetFloat(TEXT("LANSession"), TEXT("SearchQuietPeriod"), SearchQuietPeriod, GEngineIni);
+		GConfig->GetFloat(TEXT("LANSession"), TEXT("SearchMinTime"), SearchMinTime, GEngineIni);
+		GConfig->GetInt(TEXT("LANSession"), TEXT("SearchRetransmitCount"), SearchRetransmitCount, GEngineIni);
+		GConfig->GetFloat(TEXT("LANSession"), TEXT("SearchRetransmitDelay"), SearchRetransmitDelay, GEngineIni);
+		GConfig->GetInt(TEXT("LANSession"), TEXT("SearchPortRange"), SearchPortRange, GEngineIni);
+		SearchPortRange = FMath::Clamp(SearchPortRange, 1, THEIA_SEARCH_MAX_PORT_RANGE);
+		GConfig->GetBool(TEXT("LANSession"), TEXT("bLazySearchResultSettings"), bLazySearchResultSettings, GEngineIni);
+		GConfig->GetBool(TEXT("LANSession"), TEXT("bUseMulticast"), bUseMulticast, GEngineIni);
+		GConfig->GetString(TEXT("LANSession"), TEXT("MulticastGroup"), MulticastGroup, GEngineIni);
+		GConfig->GetInt(TEXT("LANSession"), TEXT("MulticastTtl"), MulticastTtl, GEngineIni);
+		MulticastTtl = FMath::Clamp(MulticastTtl, 1, 255);
+		GConfig->GetBool(TEXT("LANSession"), TEXT("bCompressSessions"), bCompressSessions, GEngineIni);
+		GConfig->GetInt(TEXT("LANSession"), TEXT("HostListenShards"), HostListenShards, GEngineIni);
+		HostListenShards = FMath::Clamp(HostListenShards, 1, THEIA_HOST_MAX_LISTEN_SHARDS);
+		GConfig->GetFloat(TEXT("LANSession"), TEXT("QueryRateLimit"), QueryRateLimit, GEngineIni);
+		GConfig->GetFloat(TEXT("LANSession"), TEXT("QueryRateBurst"), QueryRateBurst, GEngineIni);
+		QueryRateLimiter.Configure(QueryRateLimit, QueryRateBurst);
 	}
 
 	virtual ~FTheiaSession()
 	{
 		StopTheiaSession();
+		DestroyBeacons();
 	}
 
 	/**
@@ -251,10 +1090,17 @@ public:
 	bool Search(class FNboSerializeToBuffer& Packet, FOnValidResponsePacketDelegate& ResponseDelegate, FOnSearchingTimeoutDelegate& TimeoutDelegate);
 
 	/**
-	 * Stops the LAN beacon from accepting broadcasts
+	 * Stops both hosting and searching. The sockets stay open for the next Host
+	 * or Search until the session manager is destroyed
 	 */
 	void StopTheiaSession();
 
+	/** Stops answering queries, a search in progress carries on */
+	void StopHosting();
+
+	/** Stops the search in progress, hosting carries on */
+	void StopSearching();
+
 	void Tick(float DeltaTime);
 
 	/** create packet of MAX size */
@@ -262,21 +1108,158 @@ public:
 	void CreateClientQueryPacket(FNboSerializeToBuffer& Packet, uint64 ClientNonce);
 
 	/**
-	 * Uses the cached broadcast address to send packet to a subnet
+	 * Writes the same header as CreateHostResponsePacket straight into a raw buffer,
+	 * so a cached session payload only needs the client nonce stamped in front of it
+	 *
+	 * @param Buffer receives LAN_BEACON_PACKET_HEADER_SIZE bytes
+	 * @param ClientNonce the nonce sent by the querying client
+	 */
+	void StampHostResponseHeader(uint8* Buffer, uint64 ClientNonce) const;
+
+	/**
+	 * Packs as many session payloads as fit in MaxResponseDatagramSize into each
+	 * response datagram and queues them for the querying client
+	 *
+	 * @param Beacon the beacon to queue the responses on
+	 * @param Payloads the serialized sessions to send
+	 * @param ClientNonce the nonce sent by the querying client
+	 */
+	void QueueHostResponses(FTheiaBeacon& Beacon, const FSessionPayloadList& Payloads, uint64 ClientNonce) const;
+
+	/** Queues responses on the hosting beacon, see above */
+	void QueueHostResponses(const FSessionPayloadList& Payloads, uint64 ClientNonce) const
+	{
+		if (HostBeacon != NULL)
+		{
+			QueueHostResponses(*HostBeacon, Payloads, ClientNonce);
+		}
+	}
+
+	/** @return the largest serialized session that fits in a response datagram */
+	int32 GetMaxSessionPayloadSize() const
+	{
+		return MaxResponseDatagramSize - LAN_BEACON_PACKET_HEADER_SIZE - THEIA_RESPONSE_COUNT_SIZE - THEIA_RESPONSE_ENTRY_HEADER_SIZE;
+	}
+
+	/** @return the number of session bytes carried by each fragment */
+	int32 GetMaxFragmentDataSize() const
+	{
+		return MaxResponseDatagramSize - LAN_BEACON_PACKET_HEADER_SIZE - THEIA_FRAGMENT_HEADER_SIZE;
+	}
+
+	/** @return the largest serialized session that can be sent at all, in fragments if need be */
+	int32 GetMaxFragmentedSessionSize() const
+	{
+		return FMath::Min(GetMaxFragmentDataSize() * THEIA_FRAGMENT_MAX_COUNT, (int32)THEIA_FRAGMENT_MAX_SESSION_SIZE);
+	}
+
+	/**
+	 * Queues a packet for the cached broadcast address. Queued packets are sent
+	 * together once the current batch of received packets has been handled
 	 *
 	 * @param Packet the packet to send
 	 * @param Length the size of the packet to send
 	 */
 	bool BroadcastPacket(uint8* Packet, int32 Length);
 
+	/**
+	 * Queues a packet for the sender of the packet currently being handled
+	 *
+	 * @param Packet the packet to send
+	 * @param Length the size of the packet to send
+	 */
 	bool BroadcastPacketFromSocket(uint8* Packet, int32 Length);
 
+	/** @return Searching while a search is in progress, otherwise Hosting while queries are answered */
 	ELanBeaconState::Type GetBeaconState() const
 	{
-		return TheiaBeaconState;
+		if (bIsSearching)
+		{
+			return ELanBeaconState::Searching;
+		}
+		return bIsHosting ? ELanBeaconState::Hosting : ELanBeaconState::NotUsingLanBeacon;
+	}
+
+	/** @return true while queries are answered */
+	bool IsHosting() const
+	{
+		return bIsHosting;
+	}
+
+	/** @return true while a search is in progress */
+	bool IsSearching() const
+	{
+		return bIsSearching;
+	}
+
+	/** @return true if the query came from our own search, which must not list our own sessions. Safe on any thread */
+	bool IsOwnQuery(uint64 ClientNonce) const
+	{
+		const uint64 SearchNonce = GetActiveSearchNonce();
+		return SearchNonce != 0 && ClientNonce == SearchNonce;
+	}
+
+	/** @return the nonce of the search in progress, 0 if there is none. Safe on any thread */
+	uint64 GetActiveSearchNonce() const
+	{
+		return (uint64)ActiveSearchNonce.GetValue();
+	}
+
+	/** @return the codec received packet headers are checked with */
+	const FTheiaBeaconHeaderCodec& GetHeaderCodec() const
+	{
+		return HeaderCodec;
+	}
+
+	/**
+	 * Pings are measured from the first send, so a host only heard after a
+	 * retransmit reads high rather than an answer to the first query reading near zero
+	 *
+	 * @return the platform time at which the current search first sent its query
+	 */
+	double GetQuerySentTime() const
+	{
+		return TheiaQuerySentTime;
+	}
+
+	/** @return true if queries are currently answered by a dedicated beacon thread */
+	bool IsUsingBeaconThread() const
+	{
+		const int32 SocketType = GetBeaconSocketType(HostBeacon);
+		return bIsHosting && SocketType != INDEX_NONE && BeaconThreadRunnables[SocketType] != NULL;
+	}
+
+	/**
+	 * Publishes the serialized details of every session that should answer queries.
+	 * The beacon thread filters them by the query and stamps a header on each
+	 * payload when a query arrives.
+	 *
+	 * @param Payloads session details without the packet header
+	 */
+	void SetHostedResponsePayloads(const TArray<FTheiaHostedPayload>& Payloads);
+
+	/** @return the most recently published session payloads, safe to read from any thread */
+	FHostedPayloadsPtr GetHostedResponsePayloads() const;
+
+	/** @return the number of queries dropped so far because their source was over its rate limit */
+	int32 GetNumRateLimitedQueries() const
+	{
+		return NumRateLimitedQueries.GetValue();
+	}
+
+	/** @return true if hosts keep a compressed copy of their sessions, see FTheiaCompression */
+	bool ShouldCompressSessions() const
+	{
+		return bCompressSessions;
+	}
+
+	/** @return a number that changes whenever new session payloads are published */
+	int32 GetHostedPayloadsSerial() const
+	{
+		return HostedPayloadsSerial.GetValue();
 	}
 
 	DEFINE_ONLINE_DELEGATE_THREE_PARAM(OnValidQueryPacket, uint8*, int32, uint64);
-	DEFINE_ONLINE_DELEGATE_TWO_PARAM(OnValidResponsePacket, uint8*, int32);
+	DEFINE_ONLINE_DELEGATE_THREE_PARAM(OnValidResponsePacket, uint8*, int32, const FInternetAddr&);
 	DEFINE_ONLINE_DELEGATE(OnSearchingTimeout);
 };
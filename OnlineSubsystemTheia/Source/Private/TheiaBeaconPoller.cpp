@@ -0,0 +1,147 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#include "TheiaBeaconPoller.h"
+#include "TheiaBeacon.h"
+#include "HAL/PlatformProcess.h"
+#include "HAL/RunnableThread.h"
+#include "Misc/ConfigCacheIni.h"
+#include "OnlineSubsystem.h"
+
+/** The shared poller, lives until the module shuts down */
+static FTheiaBeaconPoller* GTheiaBeaconPoller = NULL;
+
+FTheiaBeaconPoller& FTheiaBeaconPoller::Get()
+{
+	if (GTheiaBeaconPoller == NULL)
+	{
+		GTheiaBeaconPoller = new FTheiaBeaconPoller();
+	}
+	return *GTheiaBeaconPoller;
+}
+
+FTheiaBeaconPoller* FTheiaBeaconPoller::GetIfExists()
+{
+	return GTheiaBeaconPoller;
+}
+
+void FTheiaBeaconPoller::TearDown()
+{
+	delete GTheiaBeaconPoller;
+	GTheiaBeaconPoller = NULL;
+}
+
+FTheiaBeaconPoller::FTheiaBeaconPoller() :
+	Thread(NULL),
+	bStopping(false)
+{
+	float PollIntervalMs = THEIA_BEACON_POLL_INTERVAL_MS;
+	GConfig->GetFloat(TEXT("LANSession"), TEXT("BeaconPollIntervalMs"), PollIntervalMs, GEngineIni);
+	PollInterval = FTimespan::FromMilliseconds(FMath::Max(PollIntervalMs, 1.f));
+
+	if (!WaitSet.IsValid())
+	{
+		UE_LOG(LogOnline, Log, TEXT("No native socket wait set on this platform, beacons will poll every tick"));
+		return;
+	}
+
+	Thread = FRunnableThread::Create(this, TEXT("TheiaBeaconPoller"), 64 * 1024, TPri_BelowNormal);
+	if (Thread == NULL)
+	{
+		UE_LOG(LogOnline, Warning, TEXT("Failed to create Theia beacon poller thread, beacons will poll every tick"));
+	}
+}
+
+FTheiaBeaconPoller::~FTheiaBeaconPoller()
+{
+	if (Thread)
+	{
+		// Stops the runnable and waits for it to exit
+		delete Thread;
+		Thread = NULL;
+	}
+}
+
+void FTheiaBeaconPoller::LockBeacons()
+{
+	NumLockWaiters.Increment();
+	Wake();
+	BeaconsLock.Lock();
+	NumLockWaiters.Decrement();
+}
+
+bool FTheiaBeaconPoller::Register(FTheiaBeacon& Beacon)
+{
+	if (Thread == NULL)
+	{
+		return false;
+	}
+
+	LockBeacons();
+	Beacons.AddUnique(&Beacon);
+	BeaconsLock.Unlock();
+	return true;
+}
+
+void FTheiaBeaconPoller::Unregister(FTheiaBeacon& Beacon)
+{
+	if (Thread == NULL)
+	{
+		return;
+	}
+
+	// Once we hold the lock the poller is out of any wait on this socket
+	LockBeacons();
+	Beacons.RemoveSingleSwap(&Beacon);
+	BeaconsLock.Unlock();
+}
+
+void FTheiaBeaconPoller::Wake()
+{
+	WaitSet.Wake();
+}
+
+uint32 FTheiaBeaconPoller::Run()
+{
+	while (!bStopping)
+	{
+		{
+			FScopeLock ScopeLock(&BeaconsLock);
+			WaitBeacons.Reset();
+			WaitSockets.Reset();
+			for (FTheiaBeacon* Beacon : Beacons)
+			{
+				// Leave flagged beacons alone until the game thread has drained them
+				if (!Beacon->IsMarkedReadable() && Beacon->GetSocket() != NULL)
+				{
+					WaitBeacons.Add(Beacon);
+					WaitSockets.Add(Beacon->GetSocket());
+				}
+			}
+
+			// One wait over every socket, woken early when a beacon is registered, removed or drained
+			if (WaitSet.Wait(WaitSockets, WaitReadable, PollInterval) > 0)
+			{
+				for (int32 Index = 0; Index < WaitBeacons.Num(); Index++)
+				{
+					if (WaitReadable[Index])
+					{
+						WaitBeacons[Index]->MarkReadable();
+					}
+				}
+			}
+		}
+
+		// Let a register or unregister have the lock before waiting again
+		while (NumLockWaiters.GetValue() > 0 && !bStopping)
+		{
+			FPlatformProcess::Sleep(0.f);
+		}
+	}
+	return 0;
+}
+
+void FTheiaBeaconPoller::Stop()
+{
+	bStopping = true;
+	Wake();
+}
@@ -0,0 +1,97 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Misc/ScopeLock.h"
+#include "Misc/Timespan.h"
+#include "TheiaNativeSocket.h"
+
+class FTheiaBeacon;
+
+#define THEIA_BEACON_POLL_INTERVAL_MS 250.f
+
+/**
+ * Process wide readiness multiplexer for beacon sockets. A single thread blocks
+ * in one wait over every registered socket and flags the beacons that have data
+ * waiting, so the game thread only reads from sockets that will not come back empty.
+ *
+ * Needs a native wait set (see FTheiaSocketWaitSet), elsewhere Register() fails
+ * and beacons are read every tick.
+ */
+class FTheiaBeaconPoller : public FRunnable
+{
+public:
+
+	/** @return the shared poller, created on first use */
+	static FTheiaBeaconPoller& Get();
+
+	/** @return the shared poller, or NULL if it hasn't been created or was torn down */
+	static FTheiaBeaconPoller* GetIfExists();
+
+	/** Stops the poller thread, called when the module shuts down */
+	static void TearDown();
+
+	virtual ~FTheiaBeaconPoller();
+
+	/**
+	 * Starts watching a beacon's socket for pending data
+	 *
+	 * @param Beacon the beacon to watch, must be unregistered before it is destroyed
+	 *
+	 * @return true if the beacon is being watched, false if the poller is unavailable
+	 */
+	bool Register(FTheiaBeacon& Beacon);
+
+	/**
+	 * Stops watching a beacon's socket. Wakes the poller and blocks until it is
+	 * out of the wait that may be using the socket
+	 *
+	 * @param Beacon the beacon to stop watching
+	 */
+	void Unregister(FTheiaBeacon& Beacon);
+
+	/** Wakes the poller so it waits again with an up to date set of sockets */
+	void Wake();
+
+	// FRunnable
+	virtual uint32 Run() override;
+	virtual void Stop() override;
+
+private:
+
+	/** Hidden on purpose, use Get() */
+	FTheiaBeaconPoller();
+
+	/** Wakes the poller and takes BeaconsLock ahead of it */
+	void LockBeacons();
+
+	/** Guards Beacons, held by the poller for the duration of a wait */
+	FCriticalSection BeaconsLock;
+
+	/** Number of threads waiting for BeaconsLock, the poller backs off while there are any */
+	FThreadSafeCounter NumLockWaiters;
+
+	/** Beacons whose sockets are being watched */
+	TArray<FTheiaBeacon*> Beacons;
+
+	/** Longest time a wait blocks before the poller looks at its beacons again */
+	FTimespan PollInterval;
+
+	/** The sockets of the beacons being waited on, plus the wake up */
+	FTheiaSocketWaitSet WaitSet;
+
+	/** Scratch for a wait, only touched by the poller thread */
+	TArray<FTheiaBeacon*> WaitBeacons;
+	TArray<FSocket*> WaitSockets;
+	TArray<bool> WaitReadable;
+
+	/** Thread running the poller */
+	class FRunnableThread* Thread;
+
+	/** Set when the thread has been asked to exit */
+	FThreadSafeBool bStopping;
+};
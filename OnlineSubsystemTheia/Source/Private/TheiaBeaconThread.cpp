@@ -0,0 +1,152 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#include "TheiaBeaconThread.h"
+#include "TheiaQueryFilters.h"
+#include "TheiaCompression.h"
+#include "NboSerializerTheia.h"
+#include "OnlineSubsystem.h"
+
+/** How long the thread blocks on the socket before checking whether it should exit */
+static const FTimespan TheiaBeaconThreadWaitTime = FTimespan::FromMilliseconds(100);
+
+FTheiaBeaconThread::FTheiaBeaconThread(FTheiaSession& InSession, FTheiaBeacon& InBeacon, bool bInAnswerQueries, bool bInCollectResponses, int32 QueueSize) :
+	Session(InSession),
+	Beacon(InBeacon),
+	bAnswerQueries(bInAnswerQueries),
+	bCollectResponses(bInCollectResponses),
+	Events(FMath::Max(QueueSize, 2)),
+	bStopping(false),
+	CachedPayloadsSerial(-1)
+{
+}
+
+uint32 FTheiaBeaconThread::Run()
+{
+	while (!bStopping)
+	{
+		// Block until something arrives so an idle beacon costs nothing
+		if (Beacon.WaitForData(TheiaBeaconThreadWaitTime))
+		{
+			int32 NumPackets = 0;
+			do
+			{
+				NumPackets = Beacon.ReceivePacketBatch();
+				// The game thread may start or stop a search at any time, use one snapshot for the whole batch
+				const uint64 SearchNonce = Session.GetActiveSearchNonce();
+				// Check every header of the batch before handling any of it
+				PacketKinds.SetNumUninitialized(NumPackets, false);
+				Session.GetHeaderCodec().ClassifyBatch(Beacon, NumPackets, SearchNonce, PacketKinds.GetData());
+				for (int32 PacketIndex = 0; PacketIndex < NumPackets; PacketIndex++)
+				{
+					ProcessPacket(Beacon.GetReceivedPacket(PacketIndex), PacketKinds[PacketIndex], SearchNonce);
+				}
+				// Send every response built for this batch at once
+				Beacon.FlushPendingPackets();
+			}
+			while (!bStopping && NumPackets == Beacon.GetBatchSize());
+		}
+	}
+	return 0;
+}
+
+void FTheiaBeaconThread::Stop()
+{
+	bStopping = true;
+}
+
+void FTheiaBeaconThread::ProcessPacket(FTheiaBeaconPacket& Received, ETheiaBeaconPacketKind::Type PacketKind, uint64 SearchNonce)
+{
+	const uint8* PacketData = Received.Data;
+	const int32 PacketLength = Received.Length;
+
+	// Route by packet type, the socket may be hosting and searching at once
+	if (PacketKind == ETheiaBeaconPacketKind::Query && bAnswerQueries)
+	{
+		const uint64 ClientNonce = FTheiaBeaconHeaderCodec::ReadNonce(PacketData);
+		// Our own search must not list our own sessions
+		const bool bIsOwnQuery = SearchNonce != 0 && ClientNonce == SearchNonce;
+		if (!bIsOwnQuery && Session.AllowQuery(*Received.Addr))
+		{
+			Beacon.SetReplyAddr(*Received.Addr);
+			AnswerQuery(&PacketData[LAN_BEACON_PACKET_HEADER_SIZE], PacketLength - LAN_BEACON_PACKET_HEADER_SIZE, ClientNonce);
+		}
+	}
+	else if (PacketKind == ETheiaBeaconPacketKind::Response && bCollectResponses)
+	{
+		// Strip off the header and hand the rest to the game thread
+		FTheiaBeaconEvent Event;
+		Event.Payload.Append(&PacketData[LAN_BEACON_PACKET_HEADER_SIZE], PacketLength - LAN_BEACON_PACKET_HEADER_SIZE);
+		// The receive slot is reused by the next batch, keep a copy of where it came from
+		Event.FromAddr = FTheiaBeacon::CloneAddr(*Received.Addr);
+		if (!Events.Enqueue(Event))
+		{
+			NumDroppedEvents.Increment();
+			UE_LOG(LogOnline, Verbose, TEXT("Theia beacon thread queue is full, dropping response"));
+		}
+	}
+	else if (PacketKind == ETheiaBeaconPacketKind::Fragment && bCollectResponses)
+	{
+		FTheiaBeaconEvent Event;
+		if (FragmentReassembler.AddFragment(&PacketData[LAN_BEACON_PACKET_HEADER_SIZE], PacketLength - LAN_BEACON_PACKET_HEADER_SIZE, SearchNonce, FPlatformTime::Seconds(), Event.Payload))
+		{
+			Event.FromAddr = FTheiaBeacon::CloneAddr(*Received.Addr);
+			if (!Events.Enqueue(Event))
+			{
+				NumDroppedEvents.Increment();
+				UE_LOG(LogOnline, Verbose, TEXT("Theia beacon thread queue is full, dropping response"));
+			}
+		}
+	}
+}
+
+void FTheiaBeaconThread::AnswerQuery(const uint8* QueryData, int32 QueryLength, uint64 ClientNonce)
+{
+	// Several threads may be answering on the same port, keep them off the payloads lock while nothing changes
+	const int32 PayloadsSerial = Session.GetHostedPayloadsSerial();
+	if (PayloadsSerial != CachedPayloadsSerial)
+	{
+		CachedPayloads = Session.GetHostedResponsePayloads();
+		CachedPayloadsSerial = PayloadsSerial;
+	}
+	const FTheiaSession::FHostedPayloadsPtr& Payloads = CachedPayloads;
+	if (!Payloads.IsValid())
+	{
+		return;
+	}
+
+	FTheiaQueryFilters Filters;
+	if (!Filters.ReadFromPacket(QueryData, QueryLength))
+	{
+		return;
+	}
+
+	const bool bAcceptsCompression = Filters.AcceptsCompression(FTheiaCompression::GetDictionaryId());
+	const bool bUsesKeyTable = Filters.UsesKeyTable(FTheiaSettingKeyDictionary::Get().GetTableId());
+	FTheiaSession::FSessionPayloadList PayloadList;
+	for (const FTheiaHostedPayload& Hosted : *Payloads)
+	{
+		if (Filters.Matches(Hosted.Settings, Hosted.NumOpenPublicConnections))
+		{
+			if (Hosted.UnchangedPayload.Num() > 0 && Filters.IsKnownSession(Hosted.VersionKey))
+			{
+				PayloadList.Add(FTheiaSession::FSessionPayloadRef(&Hosted.UnchangedPayload, THEIA_RESPONSE_UNCHANGED_FLAG));
+			}
+			else if (!bUsesKeyTable)
+			{
+				if (Hosted.ByNamePayload.Num() > 0)
+				{
+					PayloadList.Add(FTheiaSession::FSessionPayloadRef(&Hosted.ByNamePayload, 0));
+				}
+			}
+			else if (bAcceptsCompression && Hosted.CompressedPayload.Num() > 0)
+			{
+				PayloadList.Add(FTheiaSession::FSessionPayloadRef(&Hosted.CompressedPayload, THEIA_RESPONSE_COMPRESSED_FLAG));
+			}
+			else
+			{
+				PayloadList.Add(FTheiaSession::FSessionPayloadRef(&Hosted.Payload, 0));
+			}
+		}
+	}
+	Session.QueueHostResponses(Beacon, PayloadList, ClientNonce);
+}
@@ -0,0 +1,121 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+#include "HAL/ThreadSafeBool.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Containers/CircularQueue.h"
+#include "OnlineSubsystemTypes.h"
+#include "TheiaBeacon.h"
+
+/**
+ * A finished unit of beacon work handed from the beacon thread to the game thread
+ */
+struct FTheiaBeaconEvent
+{
+	/** Validated host response with the header stripped */
+	TArray<uint8> Payload;
+	/** Address the response came from */
+	TSharedPtr<FInternetAddr> FromAddr;
+};
+
+/**
+ * Runnable that owns the beacon socket while it is in use, so that receiving,
+ * header validation and building host responses stay off the game thread.
+ * Validated responses reach the game thread through a bounded SPSC queue.
+ */
+class FTheiaBeaconThread : public FRunnable
+{
+public:
+
+	/**
+	 * @param InSession the session manager whose settings are used to validate/build packets
+	 * @param InBeacon the beacon whose socket is serviced exclusively by this thread
+	 * @param bInAnswerQueries whether queries arriving on the beacon are answered
+	 * @param bInCollectResponses whether host responses arriving on the beacon are collected
+	 * @param QueueSize maximum number of events waiting for the game thread
+	 */
+	FTheiaBeaconThread(FTheiaSession& InSession, FTheiaBeacon& InBeacon, bool bInAnswerQueries, bool bInCollectResponses, int32 QueueSize);
+
+	virtual ~FTheiaBeaconThread()
+	{
+	}
+
+	// FRunnable
+	virtual uint32 Run() override;
+	virtual void Stop() override;
+
+	/**
+	 * Pops the next finished event, only to be called from the game thread
+	 *
+	 * @param OutEvent receives the event
+	 *
+	 * @return true if an event was dequeued, false if the queue is empty
+	 */
+	bool DequeueEvent(FTheiaBeaconEvent& OutEvent)
+	{
+		return Events.Dequeue(OutEvent);
+	}
+
+	/** @return the number of events dropped because the game thread fell behind */
+	int32 GetNumDroppedEvents() const
+	{
+		return NumDroppedEvents.GetValue();
+	}
+
+private:
+
+	/**
+	 * Handles a received packet according to its type
+	 *
+	 * @param Received the packet
+	 * @param PacketKind what its header was classified as
+	 * @param SearchNonce the nonce of the search in progress when the batch was read, 0 if none
+	 */
+	void ProcessPacket(FTheiaBeaconPacket& Received, ETheiaBeaconPacketKind::Type PacketKind, uint64 SearchNonce);
+
+	/**
+	 * Packs the currently published session payloads that pass the query's filters
+	 * into responses for the querying client
+	 *
+	 * @param QueryData the query with its header stripped
+	 * @param QueryLength the number of bytes in QueryData
+	 * @param ClientNonce the nonce sent by the querying client
+	 */
+	void AnswerQuery(const uint8* QueryData, int32 QueryLength, uint64 ClientNonce);
+
+	/** Session manager providing packet validation and the hosted payloads */
+	FTheiaSession& Session;
+
+	/** Beacon owned by this thread for the duration of its run */
+	FTheiaBeacon& Beacon;
+
+	/** Whether the session was hosting on this beacon when the thread was started */
+	bool bAnswerQueries;
+
+	/** Whether the session was searching on this beacon when the thread was started */
+	bool bCollectResponses;
+
+	/** Finished work waiting for the game thread */
+	TCircularQueue<FTheiaBeaconEvent> Events;
+
+	/** Set when the thread has been asked to exit */
+	FThreadSafeBool bStopping;
+
+	/** Events that did not fit in the queue */
+	FThreadSafeCounter NumDroppedEvents;
+
+	/** This thread's copy of the published session payloads, refreshed when their serial changes */
+	FTheiaSession::FHostedPayloadsPtr CachedPayloads;
+
+	/** Serial CachedPayloads was fetched at */
+	int32 CachedPayloadsSerial;
+
+	/** Reassembles fragmented sessions before they are handed to the game thread */
+	FTheiaFragmentReassembler FragmentReassembler;
+
+	/** Kinds of the packets of the batch being handled */
+	FTheiaBeaconPacketKinds PacketKinds;
+};
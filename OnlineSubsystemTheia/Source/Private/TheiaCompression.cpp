@@ -0,0 +1,145 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#include "TheiaCompression.h"
+#include "TheiaFragmentReassembler.h"
+#include "OnlineSubsystem.h"
+#include "Misc/ConfigCacheIni.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/Crc.h"
+#include "zlib.h"
+
+/**
+ * Built in dictionary, text that turns up in most sessions. Deflate finds matches
+ * near the end of the dictionary more cheaply, so the most common strings go last
+ */
+static const ANSICHAR TheiaDefaultDictionary[] =
+	"CaptureTheFlag Domination KingOfTheHill Elimination Survival Coop Versus Ranked Casual Custom "
+	"Tutorial Training Practice Tournament Lobby Warmup InProgress WaitingToStart "
+	"EU NA SA OCE ASIA us-east us-west eu-west eu-central ap-southeast ap-northeast "
+	"Mutators Mods Rules TimeLimit ScoreLimit FriendlyFire MaxPlayers Password Spectators Bots "
+	"GAMEMODE MAPNAME NUMBOTS BEACONPORT REGION CUSTOM "
+	"/Script/Engine.GameMode /Game/Blueprints/GameModes/ /Game/Maps/ /Game/Levels/ "
+	"TeamDeathmatch FreeForAll Deathmatch DESKTOP-";
+
+/** Deflate memory level, the default, every session is small anyway */
+#define THEIA_COMPRESSION_MEM_LEVEL 8
+
+/** @return the dictionary named by the config, or the built in one */
+static TArray<uint8> LoadDictionary()
+{
+	TArray<uint8> Dictionary;
+	FString DictionaryFile;
+	if (GConfig->GetString(TEXT("LANSession"), TEXT("CompressionDictionaryFile"), DictionaryFile, GEngineIni) && !DictionaryFile.IsEmpty())
+	{
+		if (!FFileHelper::LoadFileToArray(Dictionary, *FPaths::Combine(*FPaths::GameDir(), *DictionaryFile)) || Dictionary.Num() == 0)
+		{
+			UE_LOG(LogOnline, Warning, TEXT("Failed to load compression dictionary %s, using the built in one"), *DictionaryFile);
+			Dictionary.Reset();
+		}
+	}
+	if (Dictionary.Num() == 0)
+	{
+		// Without the terminator
+		Dictionary.Append((const uint8*)TheiaDefaultDictionary, sizeof(TheiaDefaultDictionary) - 1);
+	}
+	return Dictionary;
+}
+
+const TArray<uint8>& FTheiaCompression::GetDictionary()
+{
+	// Beacon threads may get here first, the static is initialized exactly once
+	static const TArray<uint8> Dictionary = LoadDictionary();
+	return Dictionary;
+}
+
+uint32 FTheiaCompression::GetDictionaryId()
+{
+	static const uint32 DictionaryId = FCrc::MemCrc32(GetDictionary().GetData(), GetDictionary().Num());
+	return DictionaryId;
+}
+
+bool FTheiaCompression::Compress(const uint8* Data, int32 Length, TArray<uint8>& OutCompressed)
+{
+	OutCompressed.Reset();
+	if (Length <= 0 || Length > THEIA_FRAGMENT_MAX_SESSION_SIZE)
+	{
+		return false;
+	}
+
+	z_stream Stream;
+	FMemory::Memzero(&Stream, sizeof(Stream));
+	// Negative window bits for a raw stream, the zlib header and checksum would cost 6 bytes
+	if (deflateInit2(&Stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, THEIA_COMPRESSION_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return false;
+	}
+
+	const TArray<uint8>& Dictionary = GetDictionary();
+	bool bSuccess = deflateSetDictionary(&Stream, Dictionary.GetData(), Dictionary.Num()) == Z_OK;
+	if (bSuccess)
+	{
+		const int32 MaxCompressedLength = (int32)deflateBound(&Stream, Length);
+		OutCompressed.SetNumUninitialized(THEIA_COMPRESSION_HEADER_SIZE + MaxCompressedLength);
+		OutCompressed[0] = (uint8)(Length >> 8);
+		OutCompressed[1] = (uint8)Length;
+		Stream.next_in = (Bytef*)Data;
+		Stream.avail_in = Length;
+		Stream.next_out = &OutCompressed[THEIA_COMPRESSION_HEADER_SIZE];
+		Stream.avail_out = MaxCompressedLength;
+		bSuccess = deflate(&Stream, Z_FINISH) == Z_STREAM_END;
+		if (bSuccess)
+		{
+			OutCompressed.SetNum(THEIA_COMPRESSION_HEADER_SIZE + (int32)Stream.total_out, false);
+		}
+	}
+	deflateEnd(&Stream);
+
+	if (!bSuccess)
+	{
+		OutCompressed.Reset();
+	}
+	return bSuccess;
+}
+
+bool FTheiaCompression::Decompress(const uint8* Data, int32 Length, TArray<uint8>& OutData)
+{
+	OutData.Reset();
+	if (Length <= THEIA_COMPRESSION_HEADER_SIZE)
+	{
+		return false;
+	}
+	const int32 OriginalLength = (Data[0] << 8) | Data[1];
+	if (OriginalLength <= 0 || OriginalLength > THEIA_FRAGMENT_MAX_SESSION_SIZE)
+	{
+		return false;
+	}
+
+	z_stream Stream;
+	FMemory::Memzero(&Stream, sizeof(Stream));
+	if (inflateInit2(&Stream, -MAX_WBITS) != Z_OK)
+	{
+		return false;
+	}
+
+	// A raw stream takes its dictionary up front, there is no header asking for it
+	const TArray<uint8>& Dictionary = GetDictionary();
+	bool bSuccess = inflateSetDictionary(&Stream, Dictionary.GetData(), Dictionary.Num()) == Z_OK;
+	if (bSuccess)
+	{
+		// The output never grows past the claimed length, whatever the stream says
+		OutData.SetNumUninitialized(OriginalLength, false);
+		Stream.next_in = (Bytef*)&Data[THEIA_COMPRESSION_HEADER_SIZE];
+		Stream.avail_in = Length - THEIA_COMPRESSION_HEADER_SIZE;
+		Stream.next_out = OutData.GetData();
+		Stream.avail_out = OriginalLength;
+		bSuccess = inflate(&Stream, Z_FINISH) == Z_STREAM_END && (int32)Stream.total_out == OriginalLength;
+	}
+	inflateEnd(&Stream);
+
+	if (!bSuccess)
+	{
+		OutData.Reset();
+	}
+	return bSuccess;
+}
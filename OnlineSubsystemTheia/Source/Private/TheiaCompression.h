@@ -0,0 +1,58 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/** Size of the original length in front of the deflate stream of a compressed session */
+#define THEIA_COMPRESSION_HEADER_SIZE 2
+
+/** A session is only sent compressed when that saves at least this many bytes */
+#define THEIA_COMPRESSION_MIN_SAVING 16
+
+/**
+ * Raw deflate primed with a dictionary shared by hosts and clients, so even a
+ * single small session compresses well: the strings it shares with the dictionary
+ * (setting names, map paths, mode names) become back references.
+ *
+ * The dictionary is built in, or loaded from CompressionDictionaryFile in [LANSession]
+ * (relative to the project directory) for games that ship one trained on their own
+ * sessions. Queries carry the dictionary id, hosts only compress for clients using
+ * the same dictionary.
+ *
+ * Compressed layout: <original length 2 bytes><raw deflate stream>
+ */
+class FTheiaCompression
+{
+public:
+
+	/** @return an id of the shared dictionary */
+	static uint32 GetDictionaryId();
+
+	/**
+	 * Compresses a serialized session
+	 *
+	 * @param Data the session to compress
+	 * @param Length the number of bytes in Data
+	 * @param OutCompressed receives the compressed session
+	 *
+	 * @return false if the session could not be compressed
+	 */
+	static bool Compress(const uint8* Data, int32 Length, TArray<uint8>& OutCompressed);
+
+	/**
+	 * Decompresses a session written by Compress
+	 *
+	 * @param Data the compressed session
+	 * @param Length the number of bytes in Data
+	 * @param OutData receives the session, never more than the length it claims
+	 *
+	 * @return false if the session is malformed or used another dictionary
+	 */
+	static bool Decompress(const uint8* Data, int32 Length, TArray<uint8>& OutData);
+
+private:
+
+	/** @return the shared dictionary, loaded on first use */
+	static const TArray<uint8>& GetDictionary();
+};
@@ -0,0 +1,113 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#include "TheiaFragmentReassembler.h"
+#include "Misc/Crc.h"
+
+FTheiaFragmentReassembler::FTheiaFragmentReassembler()
+{
+	Reset();
+}
+
+void FTheiaFragmentReassembler::Reset()
+{
+	for (FSlot& Slot : Slots)
+	{
+		// Buffers are kept, the next search is likely to need them again
+		Slot.Nonce = 0;
+		Slot.Crc = 0;
+		Slot.SessionLength = 0;
+		Slot.NumFragments = 0;
+		Slot.ReceivedMask = 0;
+		Slot.StartTime = 0.0;
+	}
+}
+
+FTheiaFragmentReassembler::FSlot* FTheiaFragmentReassembler::FindSlot(uint64 Nonce, uint32 Crc, int32 SessionLength, int32 NumFragments, double Now)
+{
+	FSlot* Oldest = NULL;
+	for (FSlot& Slot : Slots)
+	{
+		if (Slot.StartTime > 0.0 && Slot.Nonce == Nonce && Slot.Crc == Crc)
+		{
+			// A fragment of the same session that disagrees on its layout is broken
+			return (Slot.SessionLength == SessionLength && Slot.NumFragments == NumFragments) ? &Slot : NULL;
+		}
+		if (Oldest == NULL || Slot.StartTime < Oldest->StartTime)
+		{
+			Oldest = &Slot;
+		}
+	}
+
+	// Free slots have the oldest start time of all. A busy one is only taken over once it timed
+	// out, or when it belongs to an older search, so a flood can't starve the current one
+	if (Oldest->StartTime > 0.0 && Oldest->Nonce == Nonce && Now - Oldest->StartTime < THEIA_FRAGMENT_TIMEOUT)
+	{
+		return NULL;
+	}
+	Oldest->Nonce = Nonce;
+	Oldest->Crc = Crc;
+	Oldest->SessionLength = SessionLength;
+	Oldest->NumFragments = NumFragments;
+	Oldest->ReceivedMask = 0;
+	Oldest->StartTime = Now;
+	Oldest->Buffer.SetNumUninitialized(SessionLength, false);
+	return Oldest;
+}
+
+bool FTheiaFragmentReassembler::AddFragment(const uint8* Data, int32 Length, uint64 Nonce, double Now, TArray<uint8>& OutResponse)
+{
+	if (Length <= THEIA_FRAGMENT_HEADER_SIZE)
+	{
+		return false;
+	}
+
+	// Network byte order, see the layout in the header
+	const uint32 Crc = ((uint32)Data[0] << 24) | ((uint32)Data[1] << 16) | ((uint32)Data[2] << 8) | (uint32)Data[3];
+	const int32 LengthField = (Data[4] << 8) | Data[5];
+	const int32 SessionLength = LengthField & THEIA_FRAGMENT_SESSION_LENGTH_MASK;
+	const int32 Offset = (Data[6] << 8) | Data[7];
+	const int32 FragmentIndex = Data[8];
+	const int32 NumFragments = Data[9];
+	const int32 DataLength = Length - THEIA_FRAGMENT_HEADER_SIZE;
+	if (SessionLength <= 0 || SessionLength > THEIA_FRAGMENT_MAX_SESSION_SIZE ||
+		NumFragments < 2 || NumFragments > THEIA_FRAGMENT_MAX_COUNT || FragmentIndex >= NumFragments ||
+		Offset + DataLength > SessionLength)
+	{
+		return false;
+	}
+
+	FSlot* Slot = FindSlot(Nonce, Crc, SessionLength, NumFragments, Now);
+	if (Slot == NULL)
+	{
+		return false;
+	}
+
+	const uint32 FragmentBit = 1u << FragmentIndex;
+	if (Slot->ReceivedMask & FragmentBit)
+	{
+		// Hosts answer each retransmitted query, so fragments arrive more than once
+		return false;
+	}
+	FMemory::Memcpy(&Slot->Buffer[Offset], &Data[THEIA_FRAGMENT_HEADER_SIZE], DataLength);
+	Slot->ReceivedMask |= FragmentBit;
+
+	if (Slot->ReceivedMask != (1u << NumFragments) - 1)
+	{
+		return false;
+	}
+
+	// Free the slot whatever the outcome
+	Slot->StartTime = 0.0;
+	if (FCrc::MemCrc32(Slot->Buffer.GetData(), SessionLength) != Crc)
+	{
+		return false;
+	}
+
+	// Same layout as a server response holding a single session: count, length prefix, session
+	OutResponse.Reset(1 + 2 + SessionLength);
+	OutResponse.Add(1);
+	OutResponse.Add((uint8)(LengthField >> 8));
+	OutResponse.Add((uint8)LengthField);
+	OutResponse.Append(Slot->Buffer.GetData(), SessionLength);
+	return true;
+}
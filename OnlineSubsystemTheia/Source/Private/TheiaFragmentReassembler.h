@@ -0,0 +1,91 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/**
+ * A session too big for one response datagram is split into fragments, each
+ * sent with the response header but packet type 'S','F', followed by:
+ *
+ *	<session crc 4 bytes><session length 2 bytes><offset 2 bytes><fragment index byte><fragment count byte><data>
+ *
+ * The bits of the session length above THEIA_FRAGMENT_SESSION_LENGTH_MASK are flags
+ * of the session, handed on untouched in the reassembled response's length prefix.
+ */
+#define THEIA_FRAGMENT_HEADER_SIZE 10
+
+/** Bits of the session length field holding the length itself */
+#define THEIA_FRAGMENT_SESSION_LENGTH_MASK 0x3fff
+
+/** Most fragments a session is split into */
+#define THEIA_FRAGMENT_MAX_COUNT 16
+
+/** Largest serialized session sent in fragments, and accepted by clients, the most its length field holds */
+#define THEIA_FRAGMENT_MAX_SESSION_SIZE THEIA_FRAGMENT_SESSION_LENGTH_MASK
+
+/** Number of sessions a client reassembles at once */
+#define THEIA_FRAGMENT_MAX_PENDING 8
+
+/** Seconds a client waits for the rest of a session's fragments */
+#define THEIA_FRAGMENT_TIMEOUT 2.0
+
+/**
+ * Collects the fragments of oversized sessions until each one is complete. A
+ * session is keyed by the search nonce and the crc of its serialized form, which
+ * covers its SessionId, so fragments of two versions of a session never mix.
+ * Memory is bounded by a fixed number of slots, a slot whose session stalls is
+ * taken over once it times out or when every slot is busy.
+ *
+ * Not thread safe, each thread receiving responses has its own.
+ */
+class FTheiaFragmentReassembler
+{
+public:
+
+	FTheiaFragmentReassembler();
+
+	/**
+	 * Adds a received fragment
+	 *
+	 * @param Data the fragment with its packet header stripped
+	 * @param Length the number of bytes in Data
+	 * @param Nonce the nonce of the search the fragment answers
+	 * @param Now the current platform time in seconds
+	 * @param OutResponse receives a server response payload holding just the session
+	 *		once its last fragment arrives
+	 *
+	 * @return true if the fragment completed its session
+	 */
+	bool AddFragment(const uint8* Data, int32 Length, uint64 Nonce, double Now, TArray<uint8>& OutResponse);
+
+	/** Drops every partially received session */
+	void Reset();
+
+private:
+
+	/** A session being reassembled */
+	struct FSlot
+	{
+		/** Search the session answers */
+		uint64 Nonce;
+		/** Crc of the whole serialized session */
+		uint32 Crc;
+		/** Length of the whole serialized session */
+		int32 SessionLength;
+		/** Number of fragments the session was split into */
+		int32 NumFragments;
+		/** Bit per fragment index received so far */
+		uint32 ReceivedMask;
+		/** Platform time the first fragment arrived, 0 for a free slot */
+		double StartTime;
+		/** The session as far as it has arrived */
+		TArray<uint8> Buffer;
+	};
+
+	/** @return the slot collecting the session, taking one over if it is new, NULL if it can't be tracked */
+	FSlot* FindSlot(uint64 Nonce, uint32 Crc, int32 SessionLength, int32 NumFragments, double Now);
+
+	/** Sessions being reassembled */
+	FSlot Slots[THEIA_FRAGMENT_MAX_PENDING];
+};
@@ -0,0 +1,238 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#include "TheiaNativeSocket.h"
+#include "TheiaBeacon.h"
+#include "OnlineSubsystem.h"
+#include "SocketSubsystem.h"
+
+#if THEIA_HAS_NATIVE_SOCKETS
+#include "BSDSockets/SocketsBSD.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+int32 FTheiaNativeSocket::GetDescriptor(FSocket* Socket)
+{
+#if THEIA_HAS_NATIVE_SOCKETS
+	if (Socket != NULL)
+	{
+		// Every socket of the Linux socket subsystem is an FSocketBSD
+		return (int32)static_cast<FSocketBSD*>(Socket)->GetNativeSocket();
+	}
+#endif
+	return -1;
+}
+
+int32 FTheiaNativeSocket::ReceiveBatch(FSocket* Socket, FTheiaBeaconPacket* Packets, int32 NumPackets)
+{
+#if THEIA_HAS_NATIVE_SOCKETS
+	const int32 Descriptor = GetDescriptor(Socket);
+	if (Descriptor < 0)
+	{
+		return -1;
+	}
+
+	TArray<mmsghdr, TInlineAllocator<THEIA_BEACON_BATCH_SIZE>> Messages;
+	TArray<iovec, TInlineAllocator<THEIA_BEACON_BATCH_SIZE>> Buffers;
+	TArray<sockaddr_storage, TInlineAllocator<THEIA_BEACON_BATCH_SIZE>> Addrs;
+	Messages.SetNumZeroed(NumPackets);
+	Buffers.SetNumZeroed(NumPackets);
+	Addrs.SetNumZeroed(NumPackets);
+	for (int32 Index = 0; Index < NumPackets; Index++)
+	{
+		Buffers[Index].iov_base = Packets[Index].Data;
+		Buffers[Index].iov_len = THEIA_BEACON_MAX_DATAGRAM_SIZE;
+		msghdr& Header = Messages[Index].msg_hdr;
+		Header.msg_iov = &Buffers[Index];
+		Header.msg_iovlen = 1;
+		Header.msg_name = &Addrs[Index];
+		Header.msg_namelen = sizeof(sockaddr_storage);
+	}
+
+	const int32 NumReceived = recvmmsg(Descriptor, Messages.GetData(), NumPackets, MSG_DONTWAIT, NULL);
+	if (NumReceived < 0)
+	{
+		// A pending error (e.g. ICMP port unreachable) is cleared by this call, the next one reads on
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			UE_LOG(LogOnline, Verbose, TEXT("recvmmsg failed with errno %d"), errno);
+		}
+		return 0;
+	}
+
+	for (int32 Index = 0; Index < NumReceived; Index++)
+	{
+		FTheiaBeaconPacket& Slot = Packets[Index];
+		Slot.Length = (int32)Messages[Index].msg_len;
+		if (Addrs[Index].ss_family == AF_INET)
+		{
+			const sockaddr_in& Addr = (const sockaddr_in&)Addrs[Index];
+			Slot.Addr->SetIp(ntohl(Addr.sin_addr.s_addr));
+			Slot.Addr->SetPort(ntohs(Addr.sin_port));
+		}
+		else
+		{
+			// Not an address the IPv4 socket subsystem can reply to
+			Slot.Length = 0;
+		}
+	}
+	return NumReceived;
+#else
+	return -1;
+#endif
+}
+
+int32 FTheiaNativeSocket::SendBatch(FSocket* Socket, const FTheiaBeaconPacket* Packets, int32 NumPackets)
+{
+#if THEIA_HAS_NATIVE_SOCKETS
+	const int32 Descriptor = GetDescriptor(Socket);
+	if (Descriptor < 0)
+	{
+		return -1;
+	}
+
+	TArray<mmsghdr, TInlineAllocator<THEIA_BEACON_BATCH_SIZE>> Messages;
+	TArray<iovec, TInlineAllocator<THEIA_BEACON_BATCH_SIZE>> Buffers;
+	TArray<sockaddr_in, TInlineAllocator<THEIA_BEACON_BATCH_SIZE>> Addrs;
+	Messages.SetNumZeroed(NumPackets);
+	Buffers.SetNumZeroed(NumPackets);
+	Addrs.SetNumZeroed(NumPackets);
+	for (int32 Index = 0; Index < NumPackets; Index++)
+	{
+		const FTheiaBeaconPacket& Slot = Packets[Index];
+		uint32 Ip = 0;
+		Slot.Addr->GetIp(Ip);
+		if (Ip == 0)
+		{
+			// Only IPv4 destinations are built natively
+			return -1;
+		}
+		Addrs[Index].sin_family = AF_INET;
+		Addrs[Index].sin_addr.s_addr = htonl(Ip);
+		Addrs[Index].sin_port = htons((uint16)Slot.Addr->GetPort());
+
+		Buffers[Index].iov_base = (void*)Slot.Data;
+		Buffers[Index].iov_len = Slot.Length;
+		msghdr& Header = Messages[Index].msg_hdr;
+		Header.msg_iov = &Buffers[Index];
+		Header.msg_iovlen = 1;
+		Header.msg_name = &Addrs[Index];
+		Header.msg_namelen = sizeof(sockaddr_in);
+	}
+
+	int32 NumSent = 0;
+	int32 Next = 0;
+	while (Next < NumPackets)
+	{
+		const int32 Result = sendmmsg(Descriptor, &Messages[Next], NumPackets - Next, 0);
+		if (Result <= 0)
+		{
+			// sendmmsg only fails for the first datagram it was given, skip it and send the rest
+			UE_LOG(LogOnline, Verbose, TEXT("sendmmsg failed with errno %d"), errno);
+			Next++;
+		}
+		else
+		{
+			Next += Result;
+			NumSent += Result;
+		}
+	}
+	return NumSent;
+#else
+	return -1;
+#endif
+}
+
+FTheiaSocketWaitSet::FTheiaSocketWaitSet() :
+	WakeDescriptor(-1)
+{
+#if THEIA_HAS_NATIVE_SOCKETS
+	WakeDescriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (WakeDescriptor < 0)
+	{
+		UE_LOG(LogOnline, Warning, TEXT("eventfd failed with errno %d"), errno);
+	}
+#endif
+}
+
+FTheiaSocketWaitSet::~FTheiaSocketWaitSet()
+{
+#if THEIA_HAS_NATIVE_SOCKETS
+	if (WakeDescriptor >= 0)
+	{
+		close(WakeDescriptor);
+		WakeDescriptor = -1;
+	}
+#endif
+}
+
+int32 FTheiaSocketWaitSet::Wait(const TArray<FSocket*>& Sockets, TArray<bool>& OutReadable, const FTimespan& Timeout)
+{
+	OutReadable.Reset(Sockets.Num());
+	OutReadable.AddZeroed(Sockets.Num());
+#if THEIA_HAS_NATIVE_SOCKETS
+	if (WakeDescriptor < 0)
+	{
+		return 0;
+	}
+
+	// The wake descriptor goes last, after one entry per socket
+	TArray<pollfd, TInlineAllocator<8>> Descriptors;
+	Descriptors.SetNumZeroed(Sockets.Num() + 1);
+	for (int32 Index = 0; Index < Sockets.Num(); Index++)
+	{
+		Descriptors[Index].fd = FTheiaNativeSocket::GetDescriptor(Sockets[Index]);
+		Descriptors[Index].events = POLLIN;
+	}
+	Descriptors.Last().fd = WakeDescriptor;
+	Descriptors.Last().events = POLLIN;
+
+	const int32 Result = poll(Descriptors.GetData(), Descriptors.Num(), (int32)Timeout.GetTotalMilliseconds());
+	if (Result <= 0)
+	{
+		return 0;
+	}
+
+	if (Descriptors.Last().revents & POLLIN)
+	{
+		// Reset the counter so the next wait blocks again
+		uint64 NumWakes = 0;
+		if (read(WakeDescriptor, &NumWakes, sizeof(NumWakes)) < 0)
+		{
+			UE_LOG(LogOnline, VeryVerbose, TEXT("Reading the wake eventfd failed with errno %d"), errno);
+		}
+	}
+
+	int32 NumReadable = 0;
+	for (int32 Index = 0; Index < Sockets.Num(); Index++)
+	{
+		if (Descriptors[Index].revents & (POLLIN | POLLERR))
+		{
+			OutReadable[Index] = true;
+			NumReadable++;
+		}
+	}
+	return NumReadable;
+#else
+	return 0;
+#endif
+}
+
+void FTheiaSocketWaitSet::Wake()
+{
+#if THEIA_HAS_NATIVE_SOCKETS
+	if (WakeDescriptor >= 0)
+	{
+		const uint64 One = 1;
+		if (write(WakeDescriptor, &One, sizeof(One)) < 0)
+		{
+			// Only fails when the counter is saturated, in which case the wait ends anyway
+			UE_LOG(LogOnline, VeryVerbose, TEXT("Writing the wake eventfd failed with errno %d"), errno);
+		}
+	}
+#endif
+}
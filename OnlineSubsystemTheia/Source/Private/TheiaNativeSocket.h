@@ -0,0 +1,87 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/Timespan.h"
+
+/** Whether the platform sockets are BSD descriptors with recvmmsg/sendmmsg */
+#define THEIA_HAS_NATIVE_SOCKETS PLATFORM_LINUX
+
+class FSocket;
+struct FTheiaBeaconPacket;
+
+/**
+ * Moves whole batches of beacon datagrams with one system call each, which
+ * FSocket can't do (it has one RecvFrom/SendTo per datagram).
+ *
+ * Only IPv4 datagrams go through here. On platforms without native sockets
+ * every call returns -1 and the caller falls back to FSocket.
+ */
+class FTheiaNativeSocket
+{
+public:
+
+	/**
+	 * Reads as many waiting datagrams as fit in the packets, without blocking
+	 *
+	 * @param Socket the socket to read from
+	 * @param Packets the slots to fill, in order
+	 * @param NumPackets the number of slots
+	 *
+	 * @return the number of slots filled, or -1 if the socket can't be read natively
+	 */
+	static int32 ReceiveBatch(FSocket* Socket, FTheiaBeaconPacket* Packets, int32 NumPackets);
+
+	/**
+	 * Sends every packet to its address, a failed datagram doesn't stop the rest
+	 *
+	 * @param Socket the socket to send from
+	 * @param Packets the packets to send
+	 * @param NumPackets the number of packets
+	 *
+	 * @return the number of packets sent, or -1 if the socket can't be written natively
+	 */
+	static int32 SendBatch(FSocket* Socket, const FTheiaBeaconPacket* Packets, int32 NumPackets);
+
+	/** @return the descriptor behind the socket or -1 if there is none */
+	static int32 GetDescriptor(FSocket* Socket);
+};
+
+/**
+ * One blocking wait over any number of sockets, which FSocket::Wait can't do
+ * (it waits on a single socket). Wake() ends a wait early from another thread.
+ * Only available with native sockets, see IsValid().
+ */
+class FTheiaSocketWaitSet
+{
+public:
+
+	FTheiaSocketWaitSet();
+	~FTheiaSocketWaitSet();
+
+	/** @return true if waits can be made on this platform */
+	bool IsValid() const
+	{
+		return WakeDescriptor >= 0;
+	}
+
+	/**
+	 * Blocks until one of the sockets has data to read, Wake() is called or the timeout elapses
+	 *
+	 * @param Sockets the sockets to wait on, may be empty to wait for a wake up only
+	 * @param OutReadable receives whether each socket has data waiting
+	 * @param Timeout the longest time to block
+	 *
+	 * @return the number of sockets with data waiting
+	 */
+	int32 Wait(const TArray<FSocket*>& Sockets, TArray<bool>& OutReadable, const FTimespan& Timeout);
+
+	/** Ends the current or next Wait() early, callable from any thread */
+	void Wake();
+
+private:
+
+	/** eventfd written by Wake() and waited on with the sockets, -1 if there is none */
+	int32 WakeDescriptor;
+};
@@ -0,0 +1,293 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#include "TheiaQueryFilters.h"
+#include "NboSerializer.h"
+#include "TheiaCompression.h"
+#include "NboSerializerTheia.h"
+
+/** Query settings that steer the search itself rather than filter sessions */
+static bool IsSearchRoutingKey(FName Key)
+{
+	return Key == FName(TEXT("HostSessionAddr")) || Key == FName(TEXT("HostSessionPort"));
+}
+
+/** @return true if hosts know how to evaluate the filter */
+static bool IsFilterSupported(FName Key, const FOnlineSessionSearchParam& Param)
+{
+	if (IsSearchRoutingKey(Key) || Param.ComparisonOp > EOnlineComparisonOp::LessThanEquals)
+	{
+		return false;
+	}
+
+	switch (Param.Data.GetType())
+	{
+	case EOnlineKeyValuePairDataType::Bool:
+	case EOnlineKeyValuePairDataType::Int32:
+	case EOnlineKeyValuePairDataType::Int64:
+	case EOnlineKeyValuePairDataType::Float:
+	case EOnlineKeyValuePairDataType::Double:
+	case EOnlineKeyValuePairDataType::String:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/** Applies an ordered comparison, A being the session's value and B the filter's */
+template<typename ValueType>
+static bool CompareOrdered(const ValueType& A, const ValueType& B, EOnlineComparisonOp::Type ComparisonOp)
+{
+	switch (ComparisonOp)
+	{
+	case EOnlineComparisonOp::Equals:
+		return A == B;
+	case EOnlineComparisonOp::NotEquals:
+		return A != B;
+	case EOnlineComparisonOp::GreaterThan:
+		return A > B;
+	case EOnlineComparisonOp::GreaterThanEquals:
+		return A >= B;
+	case EOnlineComparisonOp::LessThan:
+		return A < B;
+	case EOnlineComparisonOp::LessThanEquals:
+		return A <= B;
+	default:
+		return true;
+	}
+}
+
+/** Only equality is checked for these, any other op is left to the client */
+template<typename ValueType>
+static bool CompareEquality(const ValueType& A, const ValueType& B, EOnlineComparisonOp::Type ComparisonOp)
+{
+	switch (ComparisonOp)
+	{
+	case EOnlineComparisonOp::Equals:
+		return A == B;
+	case EOnlineComparisonOp::NotEquals:
+		return A != B;
+	default:
+		return true;
+	}
+}
+
+/** Compares the way the client side filtering does, values of different types never match */
+static bool CompareValues(const FVariantData& A, const FVariantData& B, EOnlineComparisonOp::Type ComparisonOp)
+{
+	if (A.GetType() != B.GetType())
+	{
+		return false;
+	}
+
+	switch (A.GetType())
+	{
+	case EOnlineKeyValuePairDataType::Bool:
+	{
+		bool ValueA = false, ValueB = false;
+		A.GetValue(ValueA);
+		B.GetValue(ValueB);
+		return CompareEquality(ValueA, ValueB, ComparisonOp);
+	}
+	case EOnlineKeyValuePairDataType::Int32:
+	{
+		int32 ValueA = 0, ValueB = 0;
+		A.GetValue(ValueA);
+		B.GetValue(ValueB);
+		return CompareOrdered(ValueA, ValueB, ComparisonOp);
+	}
+	case EOnlineKeyValuePairDataType::Int64:
+	{
+		int64 ValueA = 0, ValueB = 0;
+		A.GetValue(ValueA);
+		B.GetValue(ValueB);
+		return CompareOrdered(ValueA, ValueB, ComparisonOp);
+	}
+	case EOnlineKeyValuePairDataType::Float:
+	{
+		float ValueA = 0.f, ValueB = 0.f;
+		A.GetValue(ValueA);
+		B.GetValue(ValueB);
+		return CompareOrdered(ValueA, ValueB, ComparisonOp);
+	}
+	case EOnlineKeyValuePairDataType::Double:
+	{
+		double ValueA = 0.0, ValueB = 0.0;
+		A.GetValue(ValueA);
+		B.GetValue(ValueB);
+		return CompareOrdered(ValueA, ValueB, ComparisonOp);
+	}
+	case EOnlineKeyValuePairDataType::String:
+	{
+		FString ValueA, ValueB;
+		A.GetValue(ValueA);
+		B.GetValue(ValueB);
+		return CompareEquality(ValueA, ValueB, ComparisonOp);
+	}
+	default:
+		return true;
+	}
+}
+
+void FTheiaQueryFilters::WriteToPacket(FNboSerializeToBuffer& Packet, const FOnlineSearchSettings& QuerySettings, bool bAcceptCompression, const TArray<uint64>& KnownSessionKeys)
+{
+	const int32 NumKnownSessions = FMath::Min(KnownSessionKeys.Num(), (int32)THEIA_QUERY_MAX_KNOWN_SESSIONS);
+	uint8 Capabilities = 0;
+	Capabilities |= bAcceptCompression ? THEIA_QUERY_ACCEPTS_COMPRESSION : 0;
+	Capabilities |= NumKnownSessions > 0 ? THEIA_QUERY_HAS_KNOWN_SESSIONS : 0;
+	Capabilities |= THEIA_QUERY_HAS_KEY_TABLE;
+	Packet << Capabilities;
+	if (bAcceptCompression)
+	{
+		Packet << FTheiaCompression::GetDictionaryId();
+	}
+	Packet << FTheiaSettingKeyDictionary::Get().GetTableId();
+	if (NumKnownSessions > 0)
+	{
+		Packet << (uint8)NumKnownSessions;
+		for (int32 KnownIndex = 0; KnownIndex < NumKnownSessions; KnownIndex++)
+		{
+			Packet << KnownSessionKeys[KnownIndex];
+		}
+	}
+
+	// The count is patched in once it is known
+	const int32 CountOffset = Packet.GetByteCount();
+	uint8 NumWritten = 0;
+	Packet << NumWritten;
+	if (Packet.HasOverflow())
+	{
+		return;
+	}
+
+	for (FSearchParams::TConstIterator It(QuerySettings.SearchParams); It && NumWritten < THEIA_QUERY_MAX_FILTERS; ++It)
+	{
+		const FOnlineSessionSearchParam& Param = It.Value();
+		const int32 SpaceLeft = (int32)Packet.GetBufferSize() - (int32)Packet.GetByteCount();
+		if (SpaceLeft <= 0)
+		{
+			break;
+		}
+		if (!IsFilterSupported(It.Key(), Param))
+		{
+			continue;
+		}
+
+		// Serialized on its own first, so a filter that does not fit is left out whole
+		FNboSerializeToBuffer Filter(SpaceLeft);
+		Filter << It.Key()
+			<< (uint8)Param.ComparisonOp
+			<< Param.Data;
+		if (!Filter.HasOverflow())
+		{
+			Packet.WriteBinary((uint8*)Filter, Filter.GetByteCount());
+			NumWritten++;
+		}
+	}
+
+	((uint8*)Packet)[CountOffset] = NumWritten;
+}
+
+bool FTheiaQueryFilters::ReadFromPacket(const uint8* Data, int32 Length)
+{
+	Filters.Reset();
+	KnownSessionKeys.Reset();
+	Capabilities = 0;
+	ClientDictionaryId = 0;
+	ClientKeyTableId = 0;
+
+	FNboSerializeFromBuffer Packet(Data, Length);
+	Packet >> Capabilities;
+	if (Capabilities & THEIA_QUERY_ACCEPTS_COMPRESSION)
+	{
+		Packet >> ClientDictionaryId;
+	}
+	if (Capabilities & THEIA_QUERY_HAS_KEY_TABLE)
+	{
+		Packet >> ClientKeyTableId;
+	}
+	if (Capabilities & THEIA_QUERY_HAS_KNOWN_SESSIONS)
+	{
+		uint8 NumKnownSessions = 0;
+		Packet >> NumKnownSessions;
+		for (int32 KnownIndex = 0; KnownIndex < NumKnownSessions && !Packet.HasOverflow(); KnownIndex++)
+		{
+			uint64 Key = 0;
+			Packet >> Key;
+			// Read past any extra so the filters still line up, but keep the list bounded
+			if (KnownIndex < THEIA_QUERY_MAX_KNOWN_SESSIONS)
+			{
+				KnownSessionKeys.Add(Key);
+			}
+		}
+	}
+	uint8 NumFilters = 0;
+	Packet >> NumFilters;
+	for (int32 FilterIndex = 0; FilterIndex < NumFilters && !Packet.HasOverflow(); FilterIndex++)
+	{
+		FFilter Filter;
+		FString KeyString;
+		uint8 ComparisonOp = 0;
+		Packet >> KeyString
+			>> ComparisonOp
+			>> Filter.Value;
+		Filter.ComparisonOp = (EOnlineComparisonOp::Type)ComparisonOp;
+		// Only look the key up, names from the network must not grow the name table.
+		// No setting of ours can have a key that isn't a name yet, so that filter can't reject anything
+		Filter.Key = FName(*KeyString, FNAME_Find);
+		if (Filter.Key != NAME_None)
+		{
+			Filters.Add(Filter);
+		}
+	}
+
+	if (Packet.HasOverflow())
+	{
+		Filters.Reset();
+		KnownSessionKeys.Reset();
+		Capabilities = 0;
+		return false;
+	}
+	return true;
+}
+
+bool FTheiaQueryFilters::Matches(const FOnlineSessionSettings& Settings, int32 NumOpenPublicConnections) const
+{
+	for (const FFilter& Filter : Filters)
+	{
+		bool bMatches = true;
+		// Slot counts are not advertised settings but the host knows them best
+		if (Filter.Key == SEARCH_MINSLOTSAVAILABLE && Filter.Value.GetType() == EOnlineKeyValuePairDataType::Int32)
+		{
+			int32 MinSlots = 0;
+			Filter.Value.GetValue(MinSlots);
+			bMatches = CompareOrdered(NumOpenPublicConnections, MinSlots, Filter.ComparisonOp);
+		}
+		else if (Filter.Key == SEARCH_EMPTY_SERVERS_ONLY || Filter.Key == SEARCH_NONEMPTY_SERVERS_ONLY)
+		{
+			bool bWanted = false;
+			if (Filter.Value.GetType() == EOnlineKeyValuePairDataType::Bool && Filter.ComparisonOp == EOnlineComparisonOp::Equals)
+			{
+				Filter.Value.GetValue(bWanted);
+			}
+			const bool bIsEmpty = NumOpenPublicConnections >= Settings.NumPublicConnections;
+			if (bWanted)
+			{
+				bMatches = (Filter.Key == SEARCH_EMPTY_SERVERS_ONLY) ? bIsEmpty : !bIsEmpty;
+			}
+		}
+		else if (const FOnlineSessionSetting* Setting = Settings.Settings.Find(Filter.Key))
+		{
+			// Clients never see settings that are not advertised, so neither do their filters
+			if (Setting->AdvertisementType >= EOnlineDataAdvertisementType::ViaOnlineService)
+			{
+				bMatches = CompareValues(Setting->Data, Filter.Value, Filter.ComparisonOp);
+			}
+		}
+
+		if (!bMatches)
+		{
+			return false;
+		}
+	}
+	return true;
+}
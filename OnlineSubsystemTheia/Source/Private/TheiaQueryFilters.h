@@ -0,0 +1,155 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "OnlineSessionSettings.h"
+#include "Misc/Crc.h"
+
+class FNboSerializeToBuffer;
+
+/** Most filters a query carries, any others are only applied by the client */
+#define THEIA_QUERY_MAX_FILTERS 32
+
+/** Capability bit set when the client can decompress sessions, the dictionary id follows */
+#define THEIA_QUERY_ACCEPTS_COMPRESSION 0x01
+
+/** Capability bit set when the client lists the sessions it already has, the list follows */
+#define THEIA_QUERY_HAS_KNOWN_SESSIONS 0x02
+
+/** Capability bit set when the client says which setting key table it reads, the table id follows */
+#define THEIA_QUERY_HAS_KEY_TABLE 0x04
+
+/** Most known sessions a query lists, 8 bytes each, any others are sent in full */
+#define THEIA_QUERY_MAX_KNOWN_SESSIONS 32
+
+/**
+ * Search filters carried by a query packet, so hosts with no matching session can
+ * stay silent. Hosts only drop a session the client would reject anyway, so a
+ * filter a host cannot evaluate (unknown key, unsupported op) lets the session through.
+ *
+ * Layout after the query header:
+ *
+ *	<capability byte>[<dictionary id 4 bytes>][<key table id 4 bytes>][<known count byte><session key 8 bytes>...]<count byte> then per filter <key><op byte><value>
+ *
+ * The capabilities tell the host which optional response forms the client can read.
+ * Setting keys only go out as one byte ids to clients with the same key table, see FTheiaSettingKeyDictionary.
+ * Known sessions are the ones the client kept from its last search, the host answers
+ * for those with an unchanged record as long as their version still matches.
+ */
+class FTheiaQueryFilters
+{
+public:
+
+	FTheiaQueryFilters() :
+		Capabilities(0),
+		ClientDictionaryId(0),
+		ClientKeyTableId(0)
+	{
+	}
+
+	/**
+	 * Appends the filters of a search to a query packet, leaving out those hosts
+	 * cannot evaluate and any that would not fit
+	 *
+	 * @param Packet the query packet with its header already written
+	 * @param QuerySettings the filters of the search
+	 * @param bAcceptCompression whether the client can read sessions compressed with its dictionary
+	 * @param KnownSessionKeys sessions the client already has, see MakeSessionVersionKey
+	 */
+	static void WriteToPacket(FNboSerializeToBuffer& Packet, const FOnlineSearchSettings& QuerySettings, bool bAcceptCompression, const TArray<uint64>& KnownSessionKeys);
+
+	/**
+	 * Identifies one version of a session in the known sessions list
+	 *
+	 * @param SessionId the id of the session
+	 * @param Version the version the host sent with it
+	 *
+	 * @return the crc of the id in the upper half, the version in the lower
+	 */
+	static uint64 MakeSessionVersionKey(const FString& SessionId, uint32 Version)
+	{
+		return ((uint64)FCrc::StrCrc32(*SessionId) << 32) | Version;
+	}
+
+	/**
+	 * Reads the filters following a query header
+	 *
+	 * @param Data the query with its header stripped
+	 * @param Length the number of bytes in Data
+	 *
+	 * @return false if the filters are malformed
+	 */
+	bool ReadFromPacket(const uint8* Data, int32 Length);
+
+	/**
+	 * Evaluates every filter against a hosted session
+	 *
+	 * @param Settings the settings of the session
+	 * @param NumOpenPublicConnections the public slots still open in the session
+	 *
+	 * @return false if the session is sure to be rejected by the client
+	 */
+	bool Matches(const FOnlineSessionSettings& Settings, int32 NumOpenPublicConnections) const;
+
+	/**
+	 * @param DictionaryId id of the dictionary the host compresses with
+	 *
+	 * @return true if the client can read sessions compressed with that dictionary
+	 */
+	bool AcceptsCompression(uint32 DictionaryId) const
+	{
+		return (Capabilities & THEIA_QUERY_ACCEPTS_COMPRESSION) != 0 && ClientDictionaryId == DictionaryId;
+	}
+
+	/**
+	 * @param KeyTableId id of the setting key table the host writes ids from
+	 *
+	 * @return true if the client reads setting key ids from the same table, otherwise keys must be sent by name
+	 */
+	bool UsesKeyTable(uint32 KeyTableId) const
+	{
+		return (Capabilities & THEIA_QUERY_HAS_KEY_TABLE) != 0 && ClientKeyTableId == KeyTableId;
+	}
+
+	/**
+	 * @param VersionKey the key of the session version the host would send
+	 *
+	 * @return true if the client listed that version as one it already has
+	 */
+	bool IsKnownSession(uint64 VersionKey) const
+	{
+		return KnownSessionKeys.Contains(VersionKey);
+	}
+
+	/** @return the number of filters read */
+	int32 Num() const
+	{
+		return Filters.Num();
+	}
+
+private:
+
+	/** A single key/op/value filter */
+	struct FFilter
+	{
+		FName Key;
+		EOnlineComparisonOp::Type ComparisonOp;
+		FVariantData Value;
+	};
+
+	/** Capability bits read from the query */
+	uint8 Capabilities;
+
+	/** Dictionary the client decompresses with, when it accepts compression */
+	uint32 ClientDictionaryId;
+
+	/** Setting key table the client reads ids from */
+	uint32 ClientKeyTableId;
+
+	/** Sessions the client already has, see MakeSessionVersionKey */
+	TArray<uint64, TInlineAllocator<THEIA_QUERY_MAX_KNOWN_SESSIONS>> KnownSessionKeys;
+
+	/** Filters read from the query */
+	TArray<FFilter, TInlineAllocator<8>> Filters;
+};
@@ -0,0 +1,71 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#include "TheiaQueryRateLimiter.h"
+#include "IPAddress.h"
+
+void FTheiaQueryRateLimiter::Configure(float InRate, float InBurst)
+{
+	Rate = InRate;
+	Burst = FMath::Max(InBurst, 1.f);
+	if (Rate > 0.f && Buckets.Num() == 0)
+	{
+		Buckets.AddZeroed(1 << THEIA_QUERY_RATE_TABLE_BITS);
+	}
+}
+
+uint32 FTheiaQueryRateLimiter::GetSourceKey(const FInternetAddr& Source)
+{
+	uint32 Ip = 0;
+	Source.GetIp(Ip);
+	if (Ip != 0)
+	{
+		return Ip;
+	}
+	// IPv6 addresses have no 32 bit form, hashing their text is the only portable way in
+	return GetTypeHash(Source.ToString(false));
+}
+
+bool FTheiaQueryRateLimiter::Allow(const FInternetAddr& Source, double Now)
+{
+	if (Rate <= 0.f)
+	{
+		return true;
+	}
+
+	const uint32 Key = GetSourceKey(Source);
+	// Fibonacci hashing, addresses from one subnet only differ in their low bits
+	const uint32 FirstIndex = (Key * 0x9E3779B1u) >> (32 - THEIA_QUERY_RATE_TABLE_BITS);
+	// Probes wrap around inside the stripe of the first index
+	const uint32 StripeShift = THEIA_QUERY_RATE_TABLE_BITS - THEIA_QUERY_RATE_LOCK_BITS;
+	const uint32 Stripe = FirstIndex >> StripeShift;
+	const uint32 StripeBase = Stripe << StripeShift;
+	const uint32 StripeMask = (1u << StripeShift) - 1;
+
+	FScopeLock ScopeLock(&StripeLocks[Stripe]);
+	FBucket* Stalest = NULL;
+	for (uint32 Probe = 0; Probe < THEIA_QUERY_RATE_MAX_PROBES; Probe++)
+	{
+		FBucket& Bucket = Buckets[StripeBase + ((FirstIndex + Probe) & StripeMask)];
+		if (Bucket.LastTime > 0.0 && Bucket.Key == Key)
+		{
+			Bucket.Tokens = FMath::Min(Burst, Bucket.Tokens + (float)(Now - Bucket.LastTime) * Rate);
+			Bucket.LastTime = Now;
+			if (Bucket.Tokens < 1.f)
+			{
+				return false;
+			}
+			Bucket.Tokens -= 1.f;
+			return true;
+		}
+		if (Stalest == NULL || Bucket.LastTime < Stalest->LastTime)
+		{
+			Stalest = &Bucket;
+		}
+	}
+
+	// First query from this source, or its bucket was taken over
+	Stalest->Key = Key;
+	Stalest->Tokens = Burst - 1.f;
+	Stalest->LastTime = Now;
+	return true;
+}
@@ -0,0 +1,101 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/ScopeLock.h"
+
+class FInternetAddr;
+
+/**
+ * Default sustained number of queries per second answered for one source address, 0 answers everything.
+ * Off by default, everyone behind one NAT shares a source address
+ */
+#define THEIA_QUERY_RATE_LIMIT 0.f
+
+/** Default number of queries a source may send back to back before the rate applies */
+#define THEIA_QUERY_RATE_BURST 30.f
+
+/** The bucket table holds 1 << THEIA_QUERY_RATE_TABLE_BITS sources */
+#define THEIA_QUERY_RATE_TABLE_BITS 10
+
+/** Number of neighbouring buckets searched for a source before the stalest one is taken over */
+#define THEIA_QUERY_RATE_MAX_PROBES 8
+
+/** The bucket table is split into 1 << THEIA_QUERY_RATE_LOCK_BITS stripes, each with its own lock */
+#define THEIA_QUERY_RATE_LOCK_BITS 4
+
+/**
+ * Per source address token buckets deciding which queries a host answers. Buckets
+ * live in a fixed size table allocated up front, so checking a query never
+ * allocates. When the table is crowded the least recently seen source loses its
+ * bucket and starts over with a full burst, which only ever errs towards answering.
+ *
+ * One limiter is shared by every socket answering on a port: SO_REUSEPORT spreads
+ * a source's queries over the shards by their source port, so per socket buckets
+ * would multiply its limit. Allow() is thread safe, a source only ever probes the
+ * buckets of one stripe so only that stripe's lock is taken.
+ */
+class FTheiaQueryRateLimiter
+{
+public:
+
+	FTheiaQueryRateLimiter() :
+		Rate(0.f),
+		Burst(0.f)
+	{
+	}
+
+	/**
+	 * Sets the limits, allocating the bucket table the first time limiting is enabled.
+	 * Not thread safe, call it before any query is checked
+	 *
+	 * @param InRate sustained queries per second per source, 0 or less disables limiting
+	 * @param InBurst queries a source may send back to back
+	 */
+	void Configure(float InRate, float InBurst);
+
+	/**
+	 * Takes a token from the source's bucket, callable from any thread
+	 *
+	 * @param Source the address the query came from
+	 * @param Now the current platform time in seconds
+	 *
+	 * @return false if the source is over its limit and the query should be dropped
+	 */
+	bool Allow(const FInternetAddr& Source, double Now);
+
+	/** @return true if queries are being limited */
+	bool IsEnabled() const
+	{
+		return Rate > 0.f;
+	}
+
+private:
+
+	/** Tokens left for one source */
+	struct FBucket
+	{
+		/** Identifies the source, see GetSourceKey */
+		uint32 Key;
+		/** Queries the source may still send right now */
+		float Tokens;
+		/** Platform time the bucket was last refilled, 0 for an unused bucket */
+		double LastTime;
+	};
+
+	/** @return a key for the source address, the port is left out so a client can't dodge its bucket */
+	static uint32 GetSourceKey(const FInternetAddr& Source);
+
+	/** Open addressed bucket table */
+	TArray<FBucket> Buckets;
+
+	/** Guard the stripes of Buckets */
+	FCriticalSection StripeLocks[1 << THEIA_QUERY_RATE_LOCK_BITS];
+
+	/** Tokens added to a bucket per second */
+	float Rate;
+
+	/** Most tokens a bucket holds */
+	float Burst;
+};
@@ -0,0 +1,42 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#include "TheiaSearchArena.h"
+
+FTheiaSearchArena::~FTheiaSearchArena()
+{
+	for (uint8* Block : Blocks)
+	{
+		FMemory::Free(Block);
+	}
+}
+
+void* FTheiaSearchArena::Allocate(SIZE_T Size, uint32 Alignment)
+{
+	uint8* Result = Align(Cursor, Alignment);
+	if (Cursor == NULL || Result + Size > BlockEnd)
+	{
+		// Oversized requests get a block of their own, the current one keeps filling
+		const SIZE_T BlockSize = FMath::Max<SIZE_T>(Size + Alignment, THEIA_SEARCH_ARENA_BLOCK_SIZE);
+		uint8* Block = (uint8*)FMemory::Malloc(BlockSize);
+		Blocks.Add(Block);
+		Result = Align(Block, Alignment);
+		if (BlockSize == THEIA_SEARCH_ARENA_BLOCK_SIZE || Cursor == NULL)
+		{
+			Cursor = Result + Size;
+			BlockEnd = Block + BlockSize;
+		}
+	}
+	else
+	{
+		Cursor = Result + Size;
+	}
+
+	NumAllocations++;
+	NumBytesAllocated += (int32)Size;
+	return Result;
+}
+
+uint8* FTheiaSearchArena::AllocateBytes(int32 Length)
+{
+	return Length > 0 ? (uint8*)Allocate(Length, 1) : NULL;
+}
@@ -0,0 +1,97 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+/** Size of the blocks a search arena carves its allocations from */
+#define THEIA_SEARCH_ARENA_BLOCK_SIZE (16 * 1024)
+
+/**
+ * Bump allocator for the objects a search creates per result: session infos, owner
+ * ids and undecoded settings. Each block is one heap allocation serving dozens of
+ * results, and nothing is freed on its own: the blocks go back together once the
+ * last object placed in the arena is gone. Objects hold a reference to their arena
+ * through the deleter of their shared pointer, so results outliving the search
+ * (kept by the game, joined, cached for the next search) stay valid.
+ *
+ * Containers inside the objects (strings, setting maps) still use the heap.
+ * Not thread safe, searches only read results on the game thread.
+ */
+class FTheiaSearchArena : public TSharedFromThis<FTheiaSearchArena>
+{
+public:
+
+	FTheiaSearchArena() :
+		Cursor(NULL),
+		BlockEnd(NULL),
+		NumAllocations(0),
+		NumBytesAllocated(0)
+	{
+	}
+
+	~FTheiaSearchArena();
+
+	/**
+	 * Constructs an object in the arena
+	 *
+	 * @return a shared reference whose deleter destroys the object and keeps the arena alive until then
+	 */
+	template<typename ObjectType, typename... ArgTypes>
+	TSharedRef<ObjectType> New(ArgTypes&&... Args)
+	{
+		ObjectType* Object = new (Allocate(sizeof(ObjectType), alignof(ObjectType))) ObjectType(Forward<ArgTypes>(Args)...);
+		TSharedRef<FTheiaSearchArena> Arena = AsShared();
+		return TSharedRef<ObjectType>(Object, [Arena](ObjectType* InObject)
+		{
+			InObject->~ObjectType();
+		});
+	}
+
+	/**
+	 * Allocates uninitialized bytes, they stay valid for as long as any object in the arena
+	 *
+	 * @param Length the number of bytes wanted
+	 *
+	 * @return the bytes, NULL if Length is 0
+	 */
+	uint8* AllocateBytes(int32 Length);
+
+	/** @return the number of allocations served by the arena */
+	int32 GetNumAllocations() const
+	{
+		return NumAllocations;
+	}
+
+	/** @return the number of heap blocks those allocations came from */
+	int32 GetNumBlocks() const
+	{
+		return Blocks.Num();
+	}
+
+	/** @return the number of bytes handed out */
+	int32 GetNumBytesAllocated() const
+	{
+		return NumBytesAllocated;
+	}
+
+private:
+
+	/** @return aligned memory from the current block, starting a new block when it is full */
+	void* Allocate(SIZE_T Size, uint32 Alignment);
+
+	/** Every block allocated, freed with the arena */
+	TArray<uint8*> Blocks;
+
+	/** Next free byte of the current block */
+	uint8* Cursor;
+
+	/** End of the current block */
+	uint8* BlockEnd;
+
+	/** Allocations served so far */
+	int32 NumAllocations;
+
+	/** Bytes handed out so far */
+	int32 NumBytesAllocated;
+};
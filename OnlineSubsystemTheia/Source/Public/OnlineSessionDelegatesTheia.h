@@ -0,0 +1,22 @@
+// Copyright 1998-2017 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "OnlineSessionSettings.h"
+
+/**
+ * Delegate fired at most once per tick while FindSessions is in flight, with the
+ * results received since it last fired. The search may be canceled from inside it
+ *
+ * @param NewResults sessions found since the last notification
+ */
+DECLARE_MULTICAST_DELEGATE_OneParam(FOnFindSessionsResultsReceived, const TArray<FOnlineSessionSearchResult>&);
+typedef FOnFindSessionsResultsReceived::FDelegate FOnFindSessionsResultsReceivedDelegate;
+
+/**
+ * Orders search results when FOnlineSessionSearch::MaxSearchResults limits how many are kept
+ *
+ * @return true if A should be kept over B
+ */
+typedef TFunction<bool(const FOnlineSessionSearchResult& A, const FOnlineSessionSearchResult& B)> FOnlineSearchResultComparator;
@@ -4,6 +4,7 @@
 
 #include "CoreMinimal.h"
 #include "OnlineSubsystemImpl.h"
+#include "OnlineSessionDelegatesTheia.h"
 #include "OnlineSubsystemTheiaPackage.h"
 #include "HAL/ThreadSafeCounter.h"
 
@@ -86,6 +87,43 @@ public:
 	 */
 	bool IsEnabled();
 
+	/**
+	 * Adds a delegate fired with the results of an in flight FindSessions as they
+	 * arrive, before OnFindSessionsComplete. The session interface is private to
+	 * this module, so game code registers through here
+	 *
+	 * @param Delegate the delegate to add
+	 *
+	 * @return the handle to pass to ClearOnFindSessionsResultsReceivedDelegate_Handle
+	 */
+	FDelegateHandle AddOnFindSessionsResultsReceivedDelegate_Handle(const FOnFindSessionsResultsReceivedDelegate& Delegate);
+
+	/**
+	 * Removes a delegate added with AddOnFindSessionsResultsReceivedDelegate_Handle
+	 *
+	 * @param Handle the handle of the delegate, reset once removed
+	 */
+	void ClearOnFindSessionsResultsReceivedDelegate_Handle(FDelegateHandle& Handle);
+
+	/**
+	 * Sets how results are ranked when a search has a MaxSearchResults limit, in place
+	 * of lowest ping. Pass an unset function to go back to ranking by ping
+	 *
+	 * @param Comparator returns true if its first argument should be kept over its second
+	 */
+	void SetSearchResultComparator(const FOnlineSearchResultComparator& Comparator);
+
+	/**
+	 * Decodes the advertised settings of a result taken from a search that is still
+	 * running, when [LANSession] bLazySearchResultSettings is on. Results handed over
+	 * by the search itself (on completion or to OnFindSessionsResultsReceived) are decoded already
+	 *
+	 * @param SearchResult the result to decode
+	 *
+	 * @return false if the settings are malformed, the result should be dropped
+	 */
+	bool DecodeSearchResultSettings(FOnlineSessionSearchResult& SearchResult);
+
 PACKAGE_SCOPE:
 
 	/** Only the factory makes instances */